@@ -55,7 +55,9 @@
 //    on a 32 bit boundary, it is contiguous, and its extent (start and end
 //    address) is filled in by the linker.
 // 3. All memory used by the manager is initialized to 0 as part of the
-//    runtime startup routine. No other initialization is required.
+//    runtime startup routine. No other initialization is required, unless
+//    the heap is placed in memory by the application - in that case
+//    umm_init() takes care of it and the memory does not have to be zeroed.
 //
 // The fastest linked list implementations use doubly linked lists so that
 // its possible to insert and delete blocks in constant time. This memory
@@ -75,7 +77,7 @@
 // and uses block numbers to keep track of locations. The block numbers are
 // 15 bits - which allows for up to 32767 blocks of memory. The high order
 // bit marks a block as being either free or in use, which will be explained
-// later.
+// later. (UMM_BLOCKNO_32BIT makes them 31 bits for really big heaps.)
 //
 // The result is that a block of memory on the free list uses just 8 bytes
 // instead of 16.
@@ -87,8 +89,13 @@
 //
 // Each memory block holds 8 bytes, and there are up to 32767 blocks
 // available, for about 256K of heap space. If that's not enough, you
-// can always add more data bytes to the body of the memory block
-// at the expense of free block size overhead.
+// can always add more data bytes to the body of the memory block with
+// UMM_BLOCK_BODY_SIZE at the expense of free block size overhead, or
+// switch to 32 bit block numbers, which doubles the size of the header.
+//
+// For example, 32 bit block numbers with UMM_BLOCK_BODY_SIZE set to 24
+// gives blocks of 32 bytes, and an allocated block then has an overhead of
+// 8 bytes.
 //
 // There are a lot of little features and optimizations in this memory
 // management system that makes it especially suited to small embedded, but
@@ -480,8 +487,9 @@
 //  n | ?? |  c |   ...   |            n | ?? |  s |   ...   |
 //    +----+----+----+----+              +----+----+----+----+
 //
-// Then we call free() with the adress of the data portion of the new
-// block (s) which adds it to the free list.
+// Then the new block (s) goes on the free list. It can't be merged with the
+// block after it, because umm_realloc() assimilates up before anything else,
+// so there is no need to go through all of umm_free().
 //
 // ----------------------------------------------------------------------------
 
@@ -496,10 +504,15 @@
 
 #ifndef UMM_MALLOC_CFG__DONT_BUILD
 
-#ifndef UMM_FIRST_FIT
-#  ifndef UMM_BEST_FIT
-#    define UMM_BEST_FIT
-#  endif
+// The fit that a heap starts out with, it can be changed for each heap with
+// umm_set_fit_h()
+
+#if defined UMM_NEXT_FIT
+#  define UMM_FIT_DEFAULT UMM_FIT_NEXT
+#elif defined UMM_FIRST_FIT
+#  define UMM_FIT_DEFAULT UMM_FIT_FIRST
+#else
+#  define UMM_FIT_DEFAULT UMM_FIT_BEST
 #endif
 
 #ifndef UMM_DBG_LOG_LEVEL
@@ -512,13 +525,26 @@
 
 #include "dbglog.h"
 
+// Unless each heap has its own lock, all heaps share the critical section
+
+#ifndef UMM_HEAP_CRITICAL_ENTRY
+#  define UMM_HEAP_CRITICAL_ENTRY(heap) UMM_CRITICAL_ENTRY()
+#  define UMM_HEAP_CRITICAL_EXIT(heap)  UMM_CRITICAL_EXIT()
+#endif
+
 // ----------------------------------------------------------------------------
 
 UMM_H_ATTPACKPRE typedef struct umm_ptr_t {
-   unsigned short int next;
-   unsigned short int prev;
+   umm_blockno next;
+   umm_blockno prev;
 } UMM_H_ATTPACKSUF umm_ptr;
 
+// The body of a block is big enough for the free list pointers, unless
+// UMM_BLOCK_BODY_SIZE asks for more
+
+#ifndef UMM_BLOCK_BODY_SIZE
+#  define UMM_BLOCK_BODY_SIZE (sizeof(umm_ptr))
+#endif
 
 UMM_H_ATTPACKPRE typedef struct umm_block_t {
    union {
@@ -526,12 +552,17 @@ UMM_H_ATTPACKPRE typedef struct umm_block_t {
    } header;
    union {
       umm_ptr free;
-      unsigned char data[4];
+      unsigned char data[UMM_BLOCK_BODY_SIZE];
    } body;
 } UMM_H_ATTPACKSUF umm_block;
 
-#define UMM_FREELIST_MASK (0x8000)
-#define UMM_BLOCKNO_MASK  (0x7FFF)
+// UMM_MALLOC_CONST() in umm_malloc.h works out the number of blocks on its
+// own, so make sure it has the same idea of the size of a block
+
+typedef char umm_block_bytes_check[(sizeof(umm_block) == UMM_BLOCK_BYTES) ? 1 : -1];
+
+#define UMM_FREELIST_MASK ((umm_blockno)1 << UMM_BLOCKNO_BITS)
+#define UMM_BLOCKNO_MASK  (UMM_FREELIST_MASK - 1)
 
 // ----------------------------------------------------------------------------
 
@@ -541,26 +572,48 @@ UMM_H_ATTPACKPRE typedef struct umm_block_t {
 #  define umm_free    free
 #  define umm_malloc  malloc
 #  define umm_realloc realloc
+#  define umm_calloc  calloc
+#  define umm_memalign memalign
 #endif
 
-umm_block umm_heap[(UMM_MALLOC_CFG__HEAP_SIZE / sizeof(umm_block))];
-const unsigned short int umm_numblocks = (sizeof(umm_heap) / sizeof(umm_block));
+#ifdef UMM_MALLOC_CFG__HEAP_SIZE
+
+// The heap is a static array that is set up on the first call to
+// umm_malloc(), unless umm_init() has been called before.
 
-#define UMM_NUMBLOCKS (umm_numblocks)
+umm_block umm_heap_space[(UMM_MALLOC_CFG__HEAP_SIZE / sizeof(umm_block))];
+
+umm_heap umm_default_heap = {
+   .pheap     = umm_heap_space,
+   .numblocks = (sizeof(umm_heap_space) / sizeof(umm_block)),
+   .fit       = UMM_FIT_DEFAULT
+};
 
 #else
 
-umm_block umm_heap[2600];
+// There is no static heap, umm_init() has to be called before anything else
+
+umm_heap umm_default_heap;
+
+#endif
+
+#else
 
-const unsigned short int umm_numblocks = sizeof(umm_heap)/sizeof(umm_block);
+umm_block umm_heap_space[2600];
 
-#define UMM_NUMBLOCKS (umm_numblocks)
+umm_heap umm_default_heap;
 
 #endif
 
 // ----------------------------------------------------------------------------
 
-#define UMM_BLOCK(b)  (umm_heap[b])
+// All of the functions below work on the heap context that is passed in as
+// "heap", and these macros rely on that name being in scope.
+
+#define UMM_HEAP      ((umm_block *)heap->pheap)
+#define UMM_NUMBLOCKS (heap->numblocks)
+
+#define UMM_BLOCK(b)  (UMM_HEAP[b])
 
 #define UMM_NBLOCK(b) (UMM_BLOCK(b).header.used.next)
 #define UMM_PBLOCK(b) (UMM_BLOCK(b).header.used.prev)
@@ -568,6 +621,227 @@ const unsigned short int umm_numblocks = sizeof(umm_heap)/sizeof(umm_block);
 #define UMM_PFREE(b)  (UMM_BLOCK(b).body.free.prev)
 #define UMM_DATA(b)   (UMM_BLOCK(b).body.data)
 
+#ifdef UMM_STATS
+#  define UMM_STATS_INC(n)    (++heap->stats.n)
+#  define UMM_STATS_USED(a,f) umm_stats_used( heap, (a), (f) )
+#  define UMM_STATS_FREE(b,d) umm_stats_free( heap, (b), (d) )
+#else
+#  define UMM_STATS_INC(n)    ((void)0)
+#  define UMM_STATS_USED(a,f) ((void)0)
+#  define UMM_STATS_FREE(b,d) ((void)0)
+#endif
+
+#ifdef UMM_TRACE
+#  define UMM_TRACE_PUT(op,old,ptr,size) \
+      do { if( heap->trace ) umm_trace_put( heap, (op), (old), (ptr), (size) ); } while( 0 )
+#else
+#  define UMM_TRACE_PUT(op,old,ptr,size)
+#endif
+
+// The free list entries that umm_malloc_blocks() looks at are only counted
+// with UMM_PROFILE, otherwise the profiling hooks always see 0
+
+#ifdef UMM_PROFILE
+#  define UMM_PROFILE_VISIT()   (++heap->visited)
+#  define UMM_PROFILE_VISITED() (heap->visited)
+#else
+#  define UMM_PROFILE_VISIT()
+#  define UMM_PROFILE_VISITED() (0)
+#endif
+
+// Without the segregated fits the heap keeps an upper bound for the size of
+// the blocks on the free list (not counting the end of the heap), so that a
+// request that is bigger than that can go straight to the end of the heap.
+// The bound grows whenever a bigger block is put on the free list, and a
+// scan of the whole list sets it to the size it has actually seen.
+
+#ifndef UMM_SEGREGATED_FIT
+#  define UMM_FREE_MAX(b) do { if( (b) > heap->freeMax ) heap->freeMax = (b); } while( 0 )
+#else
+#  define UMM_FREE_MAX(b)
+#endif
+
+// With UMM_CHECK_POINTERS a pointer that is not a used block of the heap is
+// logged and handed to UMM_BAD_POINTER() instead of being freed
+
+#define UMM_REFUSE_POINTER(op,ptr) \
+   do { \
+      DBG_LOG_ERROR( op " - %08lx is not a used block of this heap\n", (unsigned long)(ptr) ); \
+      UMM_BAD_POINTER( heap, (ptr) ); \
+   } while( 0 )
+
+// The cursors of umm_check_step() and umm_compact() must always be on the
+// start of a block, so code that makes block b disappear in a merge moves
+// them to block to
+
+#ifdef UMM_HANDLES
+#  define UMM_CURSOR_MOVE(b,to) \
+      do { \
+         if( (b) == heap->scrub )   heap->scrub   = (to); \
+         if( (b) == heap->compact ) heap->compact = (to); \
+      } while( 0 )
+#else
+#  define UMM_CURSOR_MOVE(b,to) \
+      do { if( (b) == heap->scrub ) heap->scrub = (to); } while( 0 )
+#endif
+
+// With UMM_CRITICAL_BUDGET every change to the free list is counted, so that
+// a scan that let go of the critical section can tell if it has to start
+// over (see umm_critical_yield() below)
+
+#ifdef UMM_CRITICAL_BUDGET
+#  define UMM_FREELIST_CHANGED() (++heap->generation)
+#else
+#  define UMM_FREELIST_CHANGED()
+#endif
+
+// ----------------------------------------------------------------------------
+// umm_init_h() sets up a heap in the memory region starting at base, which
+// must hold at least two blocks. The start of the heap is moved up by a few
+// bytes if necessary, so that the data of every block - that's what
+// umm_malloc() returns - is aligned to the size of a block. umm_memalign()
+// relies on that.
+// umm_init() does the same for the default heap that is used by umm_malloc()
+// and friends.
+//
+// Any number of heaps can be set up this way, and each of them is completely
+// independent from the others. umm_init_h() must not be called while the
+// heap is in use, so it doesn't take the critical section - that makes it
+// possible to set up the lock of the heap (see UMM_HEAP_LOCK_TYPE) before
+// or after the call. The lock is the only thing that survives, everything
+// else in the heap context starts from scratch - so the context doesn't have
+// to be zeroed before, but a trace has to be started and a fit picked with
+// umm_set_fit_h() after the call.
+//
+// This is exactly the state that the first call to umm_malloc() sets up in
+// a zeroed static heap, but only the first two blocks of the region have
+// to be cleared - so the region does not have to be zeroed before, and it
+// can be anywhere in memory, for example in a section that the linker set
+// up:
+//
+//    umm_init( __umm_heap_start, __umm_heap_end - __umm_heap_start );
+//
+//    +----+----+----+----+
+// 0  |  1 |  0 |  1 |  0 |
+//    +----+----+----+----+
+//    +----+----+----+----+
+// 1  |  0 |  0 |  0 |  0 |
+//    +----+----+----+----+
+// ----------------------------------------------------------------------------
+
+static void umm_init_heap( umm_heap *heap, void *base, size_t len, int lazy ) {
+
+   size_t skip;
+
+#ifdef UMM_HEAP_LOCK_TYPE
+   // The lock may already be set up, so don't lose it
+
+   UMM_HEAP_LOCK_TYPE lock = heap->lock;
+#endif
+
+#ifdef UMM_TRACE
+   // The static heap is only set up by the first umm_malloc(), so a trace
+   // may already have been started on it. Only then it's kept, any other
+   // context may come with garbage in it
+
+   umm_trace_entry *trace     = heap->trace;
+   unsigned int     traceSize = heap->traceSize;
+#endif
+
+   // Same for a fit that was picked with umm_set_fit_h()
+
+   unsigned char fit = heap->fit;
+
+   memset( heap, 0, sizeof( *heap ) );
+
+   heap->fit = lazy ? fit : UMM_FIT_DEFAULT;
+
+#ifdef UMM_HEAP_LOCK_TYPE
+   heap->lock = lock;
+#endif
+
+#ifdef UMM_TRACE
+   if( lazy ) {
+      heap->trace     = trace;
+      heap->traceSize = traceSize;
+   }
+#endif
+
+   skip = sizeof(umm_block) -
+          ((uintptr_t)base + sizeof(((umm_block *)0)->header)) % sizeof(umm_block);
+   skip %= sizeof(umm_block);
+
+   base = (char *)base + skip;
+   len  = (len > skip) ? (len - skip) / sizeof(umm_block) : 0;
+
+   heap->pheap     = base;
+   heap->numblocks = (len > UMM_BLOCKNO_MASK) ? UMM_BLOCKNO_MASK : len;
+
+   DBG_LOG_DEBUG( "Initializing heap of %6i blocks at 0x%08lx\n", UMM_NUMBLOCKS, (unsigned long)base );
+
+   memset( &UMM_BLOCK(0), 0, 2 * sizeof(umm_block) );
+
+   UMM_NBLOCK(0) = 1;
+   UMM_NFREE(0)  = 1;
+
+#ifndef UMM_SEGREGATED_FIT
+   heap->top = 1;
+#endif
+
+   // Nothing is known about the rest of the region, so umm_calloc() has to
+   // clear everything it hands out
+
+   heap->pristine = UMM_NUMBLOCKS;
+}
+
+void umm_init_h( umm_heap *heap, void *base, size_t len ) {
+   umm_init_heap( heap, base, len, 0 );
+}
+
+void umm_init( void *base, size_t len ) {
+
+   umm_heap *heap = &umm_default_heap;
+
+   // Protect the critical section...
+   //
+   UMM_HEAP_CRITICAL_ENTRY(heap);
+
+   umm_init_h( heap, base, len );
+
+   // Release the critical section...
+   //
+   UMM_HEAP_CRITICAL_EXIT(heap);
+}
+
+// ----------------------------------------------------------------------------
+// umm_set_fit_h() picks the way a heap looks for a free block, one of
+// UMM_FIT_BEST, UMM_FIT_FIRST or UMM_FIT_NEXT. It can be done at any time,
+// which makes it easy to compare them on the same workload. With the
+// segregated fits next fit is the same as first fit, and UMM_TLSF_FIT
+// doesn't scan at all so the fit makes no difference.
+// ----------------------------------------------------------------------------
+
+void umm_set_fit_h( umm_heap *heap, int fit ) {
+
+   // Protect the critical section...
+   //
+   UMM_HEAP_CRITICAL_ENTRY(heap);
+
+   heap->fit = fit;
+
+#ifndef UMM_SEGREGATED_FIT
+   heap->rover = 0;
+#endif
+
+   // Release the critical section...
+   //
+   UMM_HEAP_CRITICAL_EXIT(heap);
+}
+
+void umm_set_fit( int fit ) {
+   umm_set_fit_h( &umm_default_heap, fit );
+}
+
 // ----------------------------------------------------------------------------
 // One of the coolest things about this little library is that it's VERY
 // easy to get debug information about the memory heap by simply iterating
@@ -584,13 +858,13 @@ const unsigned short int umm_numblocks = sizeof(umm_heap)/sizeof(umm_block);
 
 UMM_HEAP_INFO heapInfo;
 
-void *umm_info( void *ptr, int force ) {
+void *umm_info_h( umm_heap *heap, void *ptr, int force ) {
 
-   unsigned short int blockNo = 0;
+   umm_blockno blockNo = 0;
 
    // Protect the critical section...
    //
-   UMM_CRITICAL_ENTRY();
+   UMM_HEAP_CRITICAL_ENTRY(heap);
 
    // Clear out all of the entries in the heapInfo structure before doing
    // any calculations..
@@ -639,7 +913,7 @@ void *umm_info( void *ptr, int force ) {
 
             // Release the critical section...
             //
-            UMM_CRITICAL_EXIT();
+            UMM_HEAP_CRITICAL_EXIT(heap);
 
             return( ptr );
          }
@@ -685,521 +959,4715 @@ void *umm_info( void *ptr, int force ) {
 
    // Release the critical section...
    //
-   UMM_CRITICAL_EXIT();
+   UMM_HEAP_CRITICAL_EXIT(heap);
 
    return( NULL );
 }
 
-// ----------------------------------------------------------------------------
+void *umm_info( void *ptr, int force ) {
+   return( umm_info_h( &umm_default_heap, ptr, force ) );
+}
 
-static unsigned short int umm_blocks( size_t size ) {
+// ----------------------------------------------------------------------------
 
-   // The calculation of the block size is not too difficult, but there are
-   // a few little things that we need to be mindful of.
-   //
-   // When a block removed from the free list, the space used by the free
-   // pointers is available for data. That's what the first calculation
-   // of size is doing.
+#if defined UMM_SEGREGATED_FIT || defined UMM_STATS
 
-   if( size <= (sizeof(((umm_block *)0)->body)) )
-      return( 1 );
+// Index of the most significant bit that is set in x, which must not be 0.
+// Most compilers turn this into a single instruction.
 
-   // If it's for more than that, then we need to figure out the number of
-   // additional whole blocks the size of an umm_block are required.
+static unsigned int umm_fls( unsigned int x ) {
+#if defined(__GNUC__)
+   return( (sizeof(unsigned int) * 8 - 1) - __builtin_clz( x ) );
+#else
+   unsigned int bit = 0;
 
-   size -= ( 1 + (sizeof(((umm_block *)0)->body)) );
+   while( x >>= 1 )
+      ++bit;
 
-   return( 2 + size/(sizeof(umm_block)) );
+   return( bit );
+#endif
 }
 
+#endif
+
+// ----------------------------------------------------------------------------
+// With UMM_STATS each heap keeps a few counters of its own, and umm_stats()
+// hands out a consistent copy of them.
+//
+// The free blocks are counted in a histogram by power of two of their size,
+// which is updated whenever a block goes on or off a free list or a free
+// block changes its size. The last block of the heap is not counted there,
+// it's added when the statistics are read.
 // ----------------------------------------------------------------------------
 
-static void umm_make_new_block( unsigned short int c,
-      unsigned short int blocks,
-      unsigned short int freemask ) {
+#ifdef UMM_STATS
 
-   UMM_NBLOCK(c+blocks) = UMM_NBLOCK(c) & UMM_BLOCKNO_MASK;
-   UMM_PBLOCK(c+blocks) = c;
+// Every change of the number of used blocks goes through here, so that the
+// high-water mark is always up to date
 
-   UMM_PBLOCK(UMM_NBLOCK(c) & UMM_BLOCKNO_MASK) = (c+blocks);
-   UMM_NBLOCK(c)                                = (c+blocks) | freemask;
-}
+static void umm_stats_used( umm_heap *heap, umm_blockno alloced, umm_blockno freed ) {
 
-// ----------------------------------------------------------------------------
+   heap->stats.usedBlocks += alloced;
+   heap->stats.usedBlocks -= freed;
 
-static void umm_disconnect_from_free_list( unsigned short int c ) {
-   // Disconnect this block from the FREE list
+   if( heap->stats.usedBlocks > heap->stats.usedBlocksMax )
+      heap->stats.usedBlocksMax = heap->stats.usedBlocks;
+}
 
-   UMM_NFREE(UMM_PFREE(c)) = UMM_NFREE(c);
-   UMM_PFREE(UMM_NFREE(c)) = UMM_PFREE(c);
+// ----------------------------------------------------------------------------
 
-   // And clear the free block indicator
+static void umm_stats_free( umm_heap *heap, umm_blockno blocks, int delta ) {
 
-   UMM_NBLOCK(c) &= (~UMM_FREELIST_MASK);
+   heap->stats.freeHistogram[umm_fls( blocks )] += delta;
+   heap->stats.freeEntries                      += delta;
 }
 
 // ----------------------------------------------------------------------------
+// Find the largest free block, not counting the end of the heap, and the
+// number of the last block.
 
-static void umm_assimilate_up( unsigned short int c ) {
+static umm_blockno umm_largest_free( umm_heap *heap, umm_blockno *last ) {
 
-   if( UMM_NBLOCK(UMM_NBLOCK(c)) & UMM_FREELIST_MASK ) {
-      // The next block is a free block, so assimilate up and remove it from
-      // the free list
-
-      DBG_LOG_DEBUG( "Assimilate up to next block, which is FREE\n" );
+   umm_blockno blockSize;
+   umm_blockno largest = 0;
 
-      // Disconnect the next block from the FREE list
+   umm_blockno cf;
 
-      umm_disconnect_from_free_list( UMM_NBLOCK(c) );
+#ifdef UMM_SEGREGATED_FIT
+   int bin;
 
-      // Assimilate the next block with this one
+   // All the blocks in the highest size class that is not empty are bigger
+   // than anything in the other classes, so that's the only list we have to
+   // look at - plus the last block of the heap of course
 
-      UMM_PBLOCK(UMM_NBLOCK(UMM_NBLOCK(c)) & UMM_BLOCKNO_MASK) = c;
-      UMM_NBLOCK(c) = UMM_NBLOCK(UMM_NBLOCK(c)) & UMM_BLOCKNO_MASK;
-   } 
-}
+   for( bin = UMM_NUM_BINS-1; bin >= 0; --bin ) {
+      if( heap->bins[bin] )
+         break;
+   }
 
-// ----------------------------------------------------------------------------
+   cf = (bin >= 0) ? heap->bins[bin] : 0;
 
-static unsigned short int umm_assimilate_down( unsigned short int c, unsigned short int freemask ) {
+   for( ; cf; cf = UMM_NFREE(cf) ) {
+      blockSize = (UMM_NBLOCK(cf) & UMM_BLOCKNO_MASK) - cf;
 
-   UMM_NBLOCK(UMM_PBLOCK(c)) = UMM_NBLOCK(c) | freemask;
-   UMM_PBLOCK(UMM_NBLOCK(c)) = UMM_PBLOCK(c);
+      if( blockSize > largest )
+         largest = blockSize;
+   }
 
-   return( UMM_PBLOCK(c) );
-}
+   cf = UMM_NFREE(0);
+#else
+   // Only the free list has to be walked, not the whole heap
 
-// ----------------------------------------------------------------------------
+   for( cf = UMM_NFREE(0); UMM_NFREE(cf); cf = UMM_NFREE(cf) ) {
+      blockSize = (UMM_NBLOCK(cf) & UMM_BLOCKNO_MASK) - cf;
 
-void umm_free( void *ptr ) {
+      if( blockSize > largest )
+         largest = blockSize;
+   }
+#endif
 
-   unsigned short int c;
+   *last = cf;
 
-   // If we're being asked to free a NULL pointer, well that's just silly!
+   return( largest );
+}
 
-   if( (void *)0 == ptr ) {
-      DBG_LOG_DEBUG( "free a null pointer -> do nothing\n" );
+// ----------------------------------------------------------------------------
 
-      return;
-   }
+void umm_stats_h( umm_heap *heap, UMM_HEAP_STATS *stats ) {
 
-   // FIXME: At some point it might be a good idea to add a check to make sure
-   //        that the pointer we're being asked to free up is actually within
-   //        the umm_heap!
-   //
-   // NOTE:  See the new umm_info() function that you can use to see if a ptr is
-   //        on the free list!
+   umm_blockno last;
+   umm_blockno end = 0;
 
    // Protect the critical section...
    //
-   UMM_CRITICAL_ENTRY();
+   UMM_HEAP_CRITICAL_ENTRY(heap);
 
-   // Figure out which block we're in. Note the use of truncated division...
+   memcpy( stats, &heap->stats, sizeof( *stats ) );
 
-   c = (ptr-(void *)(&(umm_heap[0])))/sizeof(umm_block);
+   // Everything except block 0 is either used or free, and the largest free
+   // block is cheap enough to find on demand
 
-   DBG_LOG_DEBUG( "Freeing block %6i\n", c );
+   stats->freeBlocks       = UMM_NUMBLOCKS - 1 - heap->stats.usedBlocks;
+   stats->largestFreeBlock = umm_largest_free( heap, &last );
 
-   // Now let's assimilate this block with the next one if possible.
+   if( last )
+      end = UMM_NUMBLOCKS - last;
 
-   umm_assimilate_up( c );
+   // Release the critical section...
+   //
+   UMM_HEAP_CRITICAL_EXIT(heap);
 
-   // Then assimilate with the previous block if possible
+   // Now add the end of the heap to the free blocks
 
-   if( UMM_NBLOCK(UMM_PBLOCK(c)) & UMM_FREELIST_MASK ) {
+   if( end ) {
+      ++stats->freeHistogram[umm_fls( end )];
+      ++stats->freeEntries;
 
-      DBG_LOG_DEBUG( "Assimilate down to next block, which is FREE\n" );
+      if( end > stats->largestFreeBlock )
+         stats->largestFreeBlock = end;
+   }
 
-      c = umm_assimilate_down(c, UMM_FREELIST_MASK);
-   } else {
-      // The previous block is not a free block, so add this one to the head
-      // of the free list
+   // The fragmentation is the percentage of the free blocks that are NOT
+   // in the largest free block - 0 means that all of the free memory can be
+   // allocated in one go.
 
-      DBG_LOG_DEBUG( "Just add to head of free list\n" );
+   if( stats->freeBlocks )
+      stats->fragmentation = 100 - (unsigned char)(((unsigned long)stats->largestFreeBlock * 100) / stats->freeBlocks);
+   else
+      stats->fragmentation = 0;
+}
 
-      UMM_PFREE(UMM_NFREE(0)) = c;
-      UMM_NFREE(c)            = UMM_NFREE(0);
-      UMM_PFREE(c)            = 0;
-      UMM_NFREE(0)            = c;
+void umm_stats( UMM_HEAP_STATS *stats ) {
+   umm_stats_h( &umm_default_heap, stats );
+}
 
-      UMM_NBLOCK(c)          |= UMM_FREELIST_MASK;
-   }
+// ----------------------------------------------------------------------------
 
-#if(0)
-   // The following is experimental code that checks to see if the block we just 
-   // freed can be assimilated with the very last block - it's pretty convoluted in
-   // terms of block index manipulation, and has absolutely no effect on heap
-   // fragmentation. I'm not sure that it's worth including but I've left it
-   // here for posterity.
+int umm_fragmentation_h( umm_heap *heap ) {
 
-   if( 0 == UMM_NBLOCK(UMM_NBLOCK(c) & UMM_BLOCKNO_MASK ) ) {
+   UMM_HEAP_STATS stats;
 
-      if( UMM_PBLOCK(UMM_NBLOCK(c) & UMM_BLOCKNO_MASK) != UMM_PFREE(UMM_NBLOCK(c) & UMM_BLOCKNO_MASK) ) {
-         UMM_NFREE(UMM_PFREE(UMM_NBLOCK(c) & UMM_BLOCKNO_MASK)) = c;
-         UMM_NFREE(UMM_PFREE(c))                                = UMM_NFREE(c);
-         UMM_PFREE(UMM_NFREE(c))                                = UMM_PFREE(c);
-         UMM_PFREE(c)                                           = UMM_PFREE(UMM_NBLOCK(c) & UMM_BLOCKNO_MASK);
-      }
+   umm_stats_h( heap, &stats );
 
-      UMM_NFREE(c)  = 0;
-      UMM_NBLOCK(c) = 0;
-   }
-#endif
+   return( stats.fragmentation );
+}
 
-   // Release the critical section...
-   //
-   UMM_CRITICAL_EXIT();
+int umm_fragmentation( void ) {
+   return( umm_fragmentation_h( &umm_default_heap ) );
 }
 
+#endif
+
+// ----------------------------------------------------------------------------
+// With UMM_TRACE every umm_malloc(), umm_free() and umm_realloc() on a heap
+// can be recorded in a ring buffer that the application hands to
+// umm_trace_start(). Recording an entry takes a few stores, so it's cheap
+// enough to leave on in production - the application drains the buffer with
+// umm_trace_read() whenever it likes, and sends the entries to a host where
+// the test main can replay them. If the buffer fills up, the oldest entries
+// are overwritten and counted in traceLost.
+//
+// Pointers are recorded as block numbers, which identify a block for as
+// long as it is allocated. An entry is written while the critical section
+// of the heap is held, so the order in the buffer is the order in which
+// the blocks changed hands.
 // ----------------------------------------------------------------------------
 
-void *umm_malloc( size_t size ) {
+#ifdef UMM_TRACE
 
-   unsigned short int blocks;
-   /* volatile --COMMENTED BY DFRANK because the version from FreeRTOS doesn't have it*/
-   unsigned short int blockSize = 0;
+static void umm_trace_put( umm_heap *heap,
+      unsigned char op,
+      umm_blockno old,
+      umm_blockno ptr,
+      size_t size ) {
 
-   unsigned short int bestSize;
-   unsigned short int bestBlock;
+   umm_trace_entry *entry = &heap->trace[heap->traceHead];
 
-   unsigned short int cf;
+   entry->time = UMM_TRACE_TIME();
+   entry->size = size;
+   entry->ptr  = ptr;
+   entry->old  = old;
+   entry->op   = op;
 
-   // the very first thing we do is figure out if we're being asked to allocate
-   // a size of 0 - and if we are we'll simply return a null pointer. if not
-   // then reduce the size by 1 byte so that the subsequent calculations on
-   // the number of blocks to allocate are easier...
+   if( ++heap->traceHead == heap->traceSize )
+      heap->traceHead = 0;
 
-   if( 0 == size ) {
-      DBG_LOG_DEBUG( "malloc a block of 0 bytes -> do nothing\n" );
+   if( heap->traceCount < heap->traceSize )
+      ++heap->traceCount;
+   else
+      ++heap->traceLost;
+}
 
-      return( (void *)NULL );
-   }
+// ----------------------------------------------------------------------------
+
+void umm_trace_start_h( umm_heap *heap, umm_trace_entry *buffer, unsigned int entries ) {
 
    // Protect the critical section...
    //
-   UMM_CRITICAL_ENTRY();
+   UMM_HEAP_CRITICAL_ENTRY(heap);
 
-   blocks = umm_blocks( size );
+   heap->trace      = entries ? buffer : (umm_trace_entry *)NULL;
+   heap->traceSize  = entries;
+   heap->traceHead  = 0;
+   heap->traceCount = 0;
+   heap->traceLost  = 0;
 
-   // Now we can scan through the free list until we find a space that's big
-   // enough to hold the number of blocks we need.
+   // Release the critical section...
    //
-   // This part may be customized to be a best-fit, worst-fit, or first-fit
-   // algorithm
+   UMM_HEAP_CRITICAL_EXIT(heap);
+}
 
-   cf = UMM_NFREE(0);
+void umm_trace_start( umm_trace_entry *buffer, unsigned int entries ) {
+   umm_trace_start_h( &umm_default_heap, buffer, entries );
+}
 
-   bestBlock = UMM_NFREE(0);
-   bestSize  = 0x7FFF;
+// ----------------------------------------------------------------------------
 
-   while( UMM_NFREE(cf) ) {
-      blockSize = (UMM_NBLOCK(cf) & UMM_BLOCKNO_MASK) - cf;
+unsigned int umm_trace_read_h( umm_heap *heap, umm_trace_entry *entries, unsigned int max ) {
 
-      DBG_LOG_TRACE( "Looking at block %6i size %6i\n", cf, blockSize );
+   unsigned int tail;
+   unsigned int n;
 
-#if defined UMM_FIRST_FIT
-      // This is the first block that fits!
-      if( (blockSize >= blocks) )
-         break;
-#elif defined UMM_BEST_FIT
-      if( (blockSize >= blocks) && (blockSize < bestSize) ) {
-         bestBlock = cf;
-         bestSize  = blockSize;
-      }
-#endif
+   // Protect the critical section...
+   //
+   UMM_HEAP_CRITICAL_ENTRY(heap);
 
-      cf = UMM_NFREE(cf);
-   }
+   // Copy out the oldest entries first
 
-   if( 0x7FFF != bestSize ) {
-      cf        = bestBlock;
-      blockSize = bestSize;
-   }
+   if( max > heap->traceCount )
+      max = heap->traceCount;
 
-   if( UMM_NBLOCK(cf) & UMM_BLOCKNO_MASK ) {
-      // This is an existing block in the memory heap, we just need to split off
-      // what we need, unlink it from the free list and mark it as in use, and
-      // link the rest of the block back into the freelist as if it was a new
-      // block on the free list...
+   tail = (heap->traceHead + heap->traceSize - heap->traceCount) % (heap->traceSize ? heap->traceSize : 1);
 
-      if( blockSize == blocks ) {
-         // It's an exact fit and we don't neet to split off a block.
-         DBG_LOG_DEBUG( "Allocating %6i blocks starting at %6i - exact\n", blocks, cf );
+   for( n = 0; n < max; ++n ) {
+      entries[n] = heap->trace[tail];
 
-         // Disconnect this block from the FREE list
+      if( ++tail == heap->traceSize )
+         tail = 0;
+   }
 
-         umm_disconnect_from_free_list( cf );
+   heap->traceCount -= max;
 
-      } else {
-         // It's not an exact fit and we need to split off a block.
-         DBG_LOG_DEBUG( "Allocating %6i blocks starting at %6i - existing\n", blocks, cf );
+   // Release the critical section...
+   //
+   UMM_HEAP_CRITICAL_EXIT(heap);
 
-         umm_make_new_block( cf, blockSize-blocks, UMM_FREELIST_MASK );
+   return( max );
+}
 
-         cf += blockSize-blocks;
-      }
+unsigned int umm_trace_read( umm_trace_entry *entries, unsigned int max ) {
+   return( umm_trace_read_h( &umm_default_heap, entries, max ) );
+}
+
+#endif
+
+// ----------------------------------------------------------------------------
+
+static umm_blockno umm_blocks( size_t size ) {
+
+   // The calculation of the block size is not too difficult, but there are
+   // a few little things that we need to be mindful of.
+   //
+   // When a block removed from the free list, the space used by the free
+   // pointers is available for data. That's what the first calculation
+   // of size is doing.
+   //
+   // With UMM_INTEGRITY there is a check value after the data.
+
+#ifdef UMM_INTEGRITY
+   if( size > (size_t)-1 - sizeof(umm_blockno) )
+      return( UMM_BLOCKNO_MASK );
+
+   size += sizeof(umm_blockno);
+#endif
+
+   if( size <= (sizeof(((umm_block *)0)->body)) )
+      return( 1 );
+
+   // If it's for more than that, then we need to figure out the number of
+   // additional whole blocks the size of an umm_block are required.
+
+   size -= ( 1 + (sizeof(((umm_block *)0)->body)) );
+
+   // A size that doesn't even fit in a block number can't be satisfied,
+   // and we must not let it wrap around to a small number of blocks.
+
+   if( size/(sizeof(umm_block)) >= UMM_BLOCKNO_MASK - 2 )
+      return( UMM_BLOCKNO_MASK );
+
+   return( 2 + size/(sizeof(umm_block)) );
+}
+
+// ----------------------------------------------------------------------------
+// The other way around - the number of bytes that the caller can use in a
+// block of the given number of blocks
+
+static size_t umm_block_bytes( umm_blockno blocks ) {
+
+   size_t size = blocks*sizeof(umm_block) - sizeof(((umm_block *)0)->header);
+
+#ifdef UMM_INTEGRITY
+   size -= sizeof(umm_blockno);
+#endif
+
+   return( size );
+}
+
+// ----------------------------------------------------------------------------
+// With UMM_SEGREGATED_FIT the free blocks are not kept on the single free list
+// that starts at block 0. Instead there is one list per size class, and the
+// heads of those lists live in the bins array of the heap context. A list is
+// terminated by a next free index of 0, and the first entry of a list has a
+// prev free index of 0, so an entry can still be unhooked in constant time
+// once we know which class it belongs to.
+//
+// The free list at block 0 is still used, but it only ever holds the last
+// block of the heap - this keeps the "end of the heap" handling in
+// umm_malloc() exactly the same in both modes.
+//
+// Blocks smaller than UMM_BIN_LINEAR get a class per block count, everything
+// else is binned by power of two (see below for the UMM_TLSF_FIT layout,
+// which splits each power of two range further). It's important that a free
+// block is disconnected from its list BEFORE its size changes, otherwise we
+// would look for it in the wrong list.
+// ----------------------------------------------------------------------------
+
+#ifdef UMM_SEGREGATED_FIT
+
+#ifdef UMM_TLSF_FIT
+
+// With UMM_TLSF_FIT the classes are laid out two-level segregated fit style.
+// The first level is the power of two range of the block count, and each
+// range is split into UMM_TLSF_SL_COUNT linear second level classes. Two
+// bitmaps record which classes have a free block:
+//
+//   fl_bitmap      - bit fl is set if any class in first level fl is not
+//                    empty
+//   sl_bitmap[fl]  - bit sl is set if the list for class (fl,sl) is not
+//                    empty
+//
+// The list head for class (fl,sl) is bins[(fl << UMM_TLSF_SL_LOG2) + sl]
+
+// Index of the least significant bit that is set in x, which must not be 0
+
+static unsigned int umm_ffs( unsigned int x ) {
+#if defined(__GNUC__)
+   return( __builtin_ctz( x ) );
+#else
+   unsigned int bit = 0;
+
+   while( !(x & 1) ) {
+      x >>= 1;
+      ++bit;
+   }
+
+   return( bit );
+#endif
+}
+
+// ----------------------------------------------------------------------------
+
+static unsigned short int umm_bin( umm_blockno blocks ) {
+
+   unsigned int fl;
+
+   if( blocks < UMM_TLSF_SL_COUNT )
+      return( blocks );
+
+   fl = umm_fls( blocks );
+
+   return( ((fl - UMM_TLSF_SL_LOG2 + 1) << UMM_TLSF_SL_LOG2) +
+           ((blocks >> (fl - UMM_TLSF_SL_LOG2)) - UMM_TLSF_SL_COUNT) );
+}
+
+// ----------------------------------------------------------------------------
+
+static umm_blockno umm_bin_search( umm_heap *heap, umm_blockno blocks ) {
+
+   unsigned int size = blocks;
+   unsigned int map  = 0;
+   unsigned int fl;
+   unsigned int bin;
+
+   umm_blockno cf;
+
+   // Round the request up to the first size of the next class, then every
+   // block in the class we find is big enough and we never have to look at
+   // the list itself...
+
+   if( blocks >= UMM_TLSF_SL_COUNT )
+      size += (1 << (umm_fls( blocks ) - UMM_TLSF_SL_LOG2)) - 1;
+
+   if( size <= UMM_BLOCKNO_MASK ) {
+      bin = umm_bin( size );
+      fl  = bin >> UMM_TLSF_SL_LOG2;
+      map = heap->sl_bitmap[fl] & (~0U << (bin & (UMM_TLSF_SL_COUNT - 1)));
+
+      if( !map ) {
+         map = heap->fl_bitmap & (~0U << (fl + 1));
+
+         if( map ) {
+            fl  = umm_ffs( map );
+            map = heap->sl_bitmap[fl];
+         }
+      }
+   }
+
+   if( map )
+      return( heap->bins[(fl << UMM_TLSF_SL_LOG2) + umm_ffs( map )] );
+
+   // The rounding may have skipped blocks in the class of the request that
+   // are big enough. Scanning that list is not bounded, so we only do it
+   // when the end of the heap can't satisfy the request either.
+
+   cf = UMM_NFREE(0);
+
+   if( cf && (UMM_NUMBLOCKS > cf+blocks+1) )
+      return( 0 );
+
+   for( cf = heap->bins[umm_bin( blocks )]; cf; cf = UMM_NFREE(cf) ) {
+      DBG_LOG_TRACE( "Looking at block %6i size %6i\n", cf, (UMM_NBLOCK(cf) & UMM_BLOCKNO_MASK) - cf );
+
+      UMM_PROFILE_VISIT();
+
+      if( ((UMM_NBLOCK(cf) & UMM_BLOCKNO_MASK) - cf) >= blocks )
+         return( cf );
+   }
+
+   return( 0 );
+}
+
+#else
+
+static unsigned short int umm_bin( umm_blockno blocks ) {
+
+   if( blocks < UMM_BIN_LINEAR )
+      return( blocks - 1 );
+
+   return( UMM_BIN_LINEAR - 1 + umm_fls( blocks ) - UMM_BIN_LINEAR_LOG2 );
+}
+
+// ----------------------------------------------------------------------------
+
+static umm_blockno umm_bin_search( umm_heap *heap, umm_blockno blocks ) {
+
+   unsigned short int bin = umm_bin( blocks );
+
+   umm_blockno blockSize;
+   umm_blockno bestSize  = UMM_BLOCKNO_MASK;
+   umm_blockno bestBlock = 0;
+
+   umm_blockno cf;
+
+   // The list for our own size class may hold blocks that are too small,
+   // so this is the only list that has to be scanned...
+
+   for( cf = heap->bins[bin]; cf; cf = UMM_NFREE(cf) ) {
+      blockSize = (UMM_NBLOCK(cf) & UMM_BLOCKNO_MASK) - cf;
+
+      DBG_LOG_TRACE( "Looking at block %6i size %6i in bin %2i\n", cf, blockSize, bin );
+
+      UMM_PROFILE_VISIT();
+
+      // Next fit has nothing to remember in a list this short, so it's
+      // the same as first fit here
+
+      if( UMM_FIT_BEST != heap->fit ) {
+         if( blockSize >= blocks )
+            return( cf );
+      } else if( (blockSize >= blocks) && (blockSize < bestSize) ) {
+         bestBlock = cf;
+         bestSize  = blockSize;
+
+         if( blockSize == blocks )
+            break;
+      }
+   }
+
+   if( bestBlock )
+      return( bestBlock );
+
+   // ... because every block in a bigger class is big enough, we simply take
+   // the first block of the next list that is not empty.
+
+   while( ++bin < UMM_NUM_BINS ) {
+      if( heap->bins[bin] )
+         return( heap->bins[bin] );
+   }
+
+   return( 0 );
+}
+
+#endif // UMM_TLSF_FIT
+
+#endif
+
+// ----------------------------------------------------------------------------
+
+static void umm_make_new_block( umm_heap *heap,
+      umm_blockno c,
+      umm_blockno blocks,
+      umm_blockno freemask ) {
+
+   UMM_NBLOCK(c+blocks) = UMM_NBLOCK(c) & UMM_BLOCKNO_MASK;
+   UMM_PBLOCK(c+blocks) = c;
+
+   UMM_PBLOCK(UMM_NBLOCK(c) & UMM_BLOCKNO_MASK) = (c+blocks);
+   UMM_NBLOCK(c)                                = (c+blocks) | freemask;
+}
+
+// ----------------------------------------------------------------------------
+
+static void umm_disconnect_from_free_list( umm_heap *heap, umm_blockno c ) {
+
+   UMM_STATS_FREE( (UMM_NBLOCK(c) & UMM_BLOCKNO_MASK) - c, -1 );
+
+   UMM_FREELIST_CHANGED();
+
+#ifndef UMM_SEGREGATED_FIT
+   // Don't leave the next fit rover on a block that is not free any more
+
+   if( c == heap->rover )
+      heap->rover = UMM_NFREE(c);
+#endif
+
+   // Disconnect this block from the FREE list
+
+#ifdef UMM_SEGREGATED_FIT
+   if( UMM_PFREE(c) ) {
+      UMM_NFREE(UMM_PFREE(c)) = UMM_NFREE(c);
+   } else {
+      unsigned short int bin = umm_bin( (UMM_NBLOCK(c) & UMM_BLOCKNO_MASK) - c );
+
+      heap->bins[bin] = UMM_NFREE(c);
+
+#ifdef UMM_TLSF_FIT
+      // That was the last block in its class, so clear the bitmaps too
+
+      if( 0 == heap->bins[bin] ) {
+         heap->sl_bitmap[bin >> UMM_TLSF_SL_LOG2] &= ~(1 << (bin & (UMM_TLSF_SL_COUNT - 1)));
+
+         if( 0 == heap->sl_bitmap[bin >> UMM_TLSF_SL_LOG2] )
+            heap->fl_bitmap &= ~(1 << (bin >> UMM_TLSF_SL_LOG2));
+      }
+#endif
+   }
+
+   if( UMM_NFREE(c) )
+      UMM_PFREE(UMM_NFREE(c)) = UMM_PFREE(c);
+#else
+   UMM_NFREE(UMM_PFREE(c)) = UMM_NFREE(c);
+   UMM_PFREE(UMM_NFREE(c)) = UMM_PFREE(c);
+#endif
+
+   // And clear the free block indicator
+
+   UMM_NBLOCK(c) &= (~UMM_FREELIST_MASK);
+}
+
+// ----------------------------------------------------------------------------
+
+static void umm_connect_to_free_list( umm_heap *heap, umm_blockno c ) {
+
+   UMM_FREE_MAX( (UMM_NBLOCK(c) & UMM_BLOCKNO_MASK) - c );
+
+#ifdef UMM_SEGREGATED_FIT
+   // Add this block to the head of the list for its size class
+
+   unsigned short int bin = umm_bin( (UMM_NBLOCK(c) & UMM_BLOCKNO_MASK) - c );
+
+   if( heap->bins[bin] )
+      UMM_PFREE(heap->bins[bin]) = c;
+
+   UMM_NFREE(c)  = heap->bins[bin];
+   UMM_PFREE(c)  = 0;
+   heap->bins[bin] = c;
+
+#ifdef UMM_TLSF_FIT
+   heap->sl_bitmap[bin >> UMM_TLSF_SL_LOG2] |= (1 << (bin & (UMM_TLSF_SL_COUNT - 1)));
+   heap->fl_bitmap                           |= (1 << (bin >> UMM_TLSF_SL_LOG2));
+#endif
+#elif defined UMM_ADDRESS_ORDERED
+   // Keep the free list sorted by address. The nearest free block on either
+   // side of c in the block chain tells us where c goes, so walk both ways
+   // at once - that takes as long as the shorter run of used blocks next to
+   // c, not as long as the free list. The walk up always ends, because the
+   // last block of the heap is the last entry of the free list.
+
+   umm_blockno prev = c;
+   umm_blockno next = c;
+
+   while( 1 ) {
+      prev = UMM_PBLOCK(prev);
+
+      if( (0 == prev) || (UMM_NBLOCK(prev) & UMM_FREELIST_MASK) )
+         break;
+
+      next = UMM_NBLOCK(next) & UMM_BLOCKNO_MASK;
+
+      if( (0 == UMM_NBLOCK(next)) || (UMM_NBLOCK(next) & UMM_FREELIST_MASK) ) {
+         prev = UMM_PFREE(next);
+         break;
+      }
+   }
+
+   next = UMM_NFREE(prev);
+
+   UMM_PFREE(next) = c;
+   UMM_NFREE(c)    = next;
+   UMM_PFREE(c)    = prev;
+   UMM_NFREE(prev) = c;
+#else
+   // Add this block to the head of the free list
+
+   UMM_PFREE(UMM_NFREE(0)) = c;
+   UMM_NFREE(c)            = UMM_NFREE(0);
+   UMM_PFREE(c)            = 0;
+   UMM_NFREE(0)            = c;
+#endif
+
+   // And set the free block indicator
+
+   UMM_NBLOCK(c) |= UMM_FREELIST_MASK;
+
+   UMM_STATS_FREE( (UMM_NBLOCK(c) & UMM_BLOCKNO_MASK) - c, 1 );
+}
+
+// ----------------------------------------------------------------------------
+// With UMM_INTEGRITY the last few bytes of every used block hold a check
+// value that is made from the block number and the next block pointer, so
+// the header of a block can't be changed without it showing. It sits right
+// after the data, so it also catches small overruns. umm_blocks() makes room
+// for it, and everything that hands out a block seals it.
+//
+// With UMM_POISON_FREE the first UMM_POISON_SIZE bytes after the free list
+// pointers of every free block are filled with UMM_POISON_BYTE. They are
+// checked when the block is merged with another one, so a write through a
+// pointer that was already freed shows up sooner or later. Only a few bytes
+// are done, so freeing a big block does not cost more than a small one -
+// but they are done again after every merge, because a small block that
+// grows has more bytes to poison.
+//
+// Anything that does not look right is passed to UMM_HEAP_CORRUPT().
+// ----------------------------------------------------------------------------
+
+#ifdef UMM_INTEGRITY
+
+#define UMM_SEAL_VALUE(c,n) ((umm_blockno)(~(c) ^ ((n) << 3) ^ ((n) >> 2)))
+
+static umm_blockno *umm_seal_of( umm_heap *heap, umm_blockno c ) {
+   return( (umm_blockno *)&UMM_BLOCK(UMM_NBLOCK(c) & UMM_BLOCKNO_MASK) - 1 );
+}
+
+static void umm_seal( umm_heap *heap, umm_blockno c ) {
+   *umm_seal_of( heap, c ) = UMM_SEAL_VALUE( c, UMM_NBLOCK(c) );
+}
+
+// Returns 1 if the used block c is intact - the next block pointer has to
+// be sane before the check value can even be looked at
+
+static int umm_sealed( umm_heap *heap, umm_blockno c ) {
+
+   umm_blockno n = UMM_NBLOCK(c);
+
+   if( (n <= c) || (n >= UMM_NUMBLOCKS) || (UMM_PBLOCK(n) != c) ||
+       (*umm_seal_of( heap, c ) != UMM_SEAL_VALUE( c, n )) ) {
+      DBG_LOG_ERROR( "Used block %6i is corrupt\n", c );
+
+      UMM_HEAP_CORRUPT( heap, c );
+
+      return( 0 );
+   }
+
+   return( 1 );
+}
+
+#  define UMM_SEAL(c)   umm_seal( heap, (c) )
+#  define UMM_SEALED(c) umm_sealed( heap, (c) )
+#else
+#  define UMM_SEAL(c)   ((void)0)
+#  define UMM_SEALED(c) (1)
+#endif
+
+#ifdef UMM_POISON_FREE
+
+static size_t umm_poison_size( umm_heap *heap, umm_blockno c ) {
+
+   size_t size = ((UMM_NBLOCK(c) & UMM_BLOCKNO_MASK) - c) * sizeof(umm_block)
+                 - sizeof(((umm_block *)0)->header) - sizeof(umm_ptr);
+
+   return( size < UMM_POISON_SIZE ? size : UMM_POISON_SIZE );
+}
+
+static void umm_poison( umm_heap *heap, umm_blockno c ) {
+   memset( (unsigned char *)&UMM_DATA(c) + sizeof(umm_ptr), UMM_POISON_BYTE,
+           umm_poison_size( heap, c ) );
+}
+
+static int umm_poisoned( umm_heap *heap, umm_blockno c ) {
+
+   unsigned char *p    = (unsigned char *)&UMM_DATA(c) + sizeof(umm_ptr);
+   size_t         size = umm_poison_size( heap, c );
+
+   while( size-- ) {
+      if( UMM_POISON_BYTE != *p++ ) {
+         DBG_LOG_ERROR( "Free block %6i was written to\n", c );
+
+         UMM_HEAP_CORRUPT( heap, c );
+
+         return( 0 );
+      }
+   }
+
+   return( 1 );
+}
+
+#  define UMM_POISON(c)   umm_poison( heap, (c) )
+#  define UMM_POISONED(c) umm_poisoned( heap, (c) )
+#else
+#  define UMM_POISON(c)   ((void)0)
+#  define UMM_POISONED(c) (1)
+#endif
+
+// ----------------------------------------------------------------------------
+
+static void umm_assimilate_up( umm_heap *heap, umm_blockno c ) {
+
+   if( UMM_NBLOCK(UMM_NBLOCK(c)) & UMM_FREELIST_MASK ) {
+      // The next block is a free block, so assimilate up and remove it from
+      // the free list
+
+      DBG_LOG_DEBUG( "Assimilate up to next block, which is FREE\n" );
+
+      // It's free already, so a write to it can only be reported
+
+      (void)UMM_POISONED( UMM_NBLOCK(c) );
+
+      // Disconnect the next block from the FREE list
+
+      umm_disconnect_from_free_list( heap, UMM_NBLOCK(c) );
+
+      UMM_CURSOR_MOVE( UMM_NBLOCK(c), c );
+
+      // Assimilate the next block with this one
+
+      UMM_PBLOCK(UMM_NBLOCK(UMM_NBLOCK(c)) & UMM_BLOCKNO_MASK) = c;
+      UMM_NBLOCK(c) = UMM_NBLOCK(UMM_NBLOCK(c)) & UMM_BLOCKNO_MASK;
+   } 
+}
+
+// ----------------------------------------------------------------------------
+
+static umm_blockno umm_assimilate_down( umm_heap *heap, umm_blockno c, umm_blockno freemask ) {
+
+   (void)UMM_POISONED( UMM_PBLOCK(c) );
+
+   UMM_CURSOR_MOVE( c, UMM_PBLOCK(c) );
+
+   UMM_NBLOCK(UMM_PBLOCK(c)) = UMM_NBLOCK(c) | freemask;
+   UMM_PBLOCK(UMM_NBLOCK(c)) = UMM_PBLOCK(c);
+
+   return( UMM_PBLOCK(c) );
+}
+
+// ----------------------------------------------------------------------------
+// Grow block c, which must be followed by the end of the heap, to the given
+// number of blocks - the last block simply moves up to make room. The caller
+// has to make sure that there is enough space left in the heap.
+
+static void umm_grow_into_end( umm_heap *heap, umm_blockno c, umm_blockno blocks ) {
+
+   umm_blockno end = UMM_NBLOCK(c);
+
+   UMM_FREELIST_CHANGED();
+
+   UMM_CURSOR_MOVE( end, 0 );
+
+#ifndef UMM_SEGREGATED_FIT
+   if( end == heap->rover )
+      heap->rover = 0;
+
+   heap->top = c+blocks;
+#endif
+
+   UMM_NFREE(UMM_PFREE(end)) = c+blocks;
+
+   memcpy( &UMM_BLOCK(c+blocks), &UMM_BLOCK(end), sizeof(umm_block) );
+
+   UMM_NBLOCK(c) = c+blocks;
+
+   if( heap->pristine <= c+blocks )
+      heap->pristine = c+blocks+1;
+}
+
+// ----------------------------------------------------------------------------
+// Make the free block c, which is followed by the last block of the heap, the
+// last block itself. The last block is always the last entry of the free
+// list at block 0, so c takes its place there.
+
+static void umm_merge_into_end( umm_heap *heap, umm_blockno c ) {
+
+   umm_blockno end = UMM_NBLOCK(c) & UMM_BLOCKNO_MASK;
+
+   DBG_LOG_DEBUG( "Merge %6i blocks at %6i into the end of the heap\n", end - c, c );
+
+   umm_disconnect_from_free_list( heap, c );
+
+   UMM_NFREE(UMM_PFREE(end)) = c;
+   UMM_PFREE(c)              = UMM_PFREE(end);
+   UMM_NFREE(c)              = 0;
+   UMM_NBLOCK(c)             = 0;
+
+#ifndef UMM_SEGREGATED_FIT
+   if( end == heap->rover )
+      heap->rover = 0;
+
+   heap->top = c;
+#endif
+
+   UMM_CURSOR_MOVE( end, 0 );
+}
+
+// ----------------------------------------------------------------------------
+// umm_free_block() and umm_malloc_blocks() do the real work for umm_free()
+// and umm_malloc(). They deal in block numbers and expect the caller to hold
+// the critical section of the heap, so they can be used to do several
+// operations in one go.
+// ----------------------------------------------------------------------------
+
+static void umm_free_block( umm_heap *heap, umm_blockno c ) {
+
+   DBG_LOG_DEBUG( "Freeing block %6i\n", c );
+
+   UMM_STATS_USED( 0, UMM_NBLOCK(c) - c );
+
+   UMM_FREELIST_CHANGED();
+
+   // Now let's assimilate this block with the next one if possible.
+
+   umm_assimilate_up( heap, c );
+
+   // Then assimilate with the previous block if possible
+
+   if( UMM_NBLOCK(UMM_PBLOCK(c)) & UMM_FREELIST_MASK ) {
+
+      DBG_LOG_DEBUG( "Assimilate down to next block, which is FREE\n" );
+
+#ifdef UMM_SEGREGATED_FIT
+      // The previous block is about to grow, so it may have to move to the
+      // list for a bigger size class
+
+      umm_disconnect_from_free_list( heap, UMM_PBLOCK(c) );
+
+      c = umm_assimilate_down(heap, c, 0);
+
+      umm_connect_to_free_list( heap, c );
+#else
+      UMM_STATS_FREE( c - UMM_PBLOCK(c), -1 );
+
+      c = umm_assimilate_down(heap, c, UMM_FREELIST_MASK);
+
+      UMM_STATS_FREE( (UMM_NBLOCK(c) & UMM_BLOCKNO_MASK) - c, 1 );
+
+      UMM_FREE_MAX( (UMM_NBLOCK(c) & UMM_BLOCKNO_MASK) - c );
+#endif
+   } else {
+      // The previous block is not a free block, so add this one to the head
+      // of the free list (or where it belongs with UMM_ADDRESS_ORDERED)
+
+      DBG_LOG_DEBUG( "Just add to head of free list\n" );
+
+      umm_connect_to_free_list( heap, c );
+   }
+
+   // If the block we just freed ends up right below the last block of the
+   // heap, it becomes the new last block. That keeps the end of the heap one
+   // big piece, which umm_malloc() can take anything from without a scan.
+
+   if( 0 == UMM_NBLOCK(UMM_NBLOCK(c) & UMM_BLOCKNO_MASK) )
+      umm_merge_into_end( heap, c );
+   else
+      UMM_POISON( c );
+}
+
+// ----------------------------------------------------------------------------
+// Cut the used block c down to the given number of blocks and give the rest
+// back. umm_realloc() has usually assimilated up already, but the rest still
+// takes a free block after it if there is one, so the caller can't leave two
+// free blocks next to each other. It can't be merged with the block before it
+// though, which is c, so it goes straight to the free list instead of through
+// all the checks in umm_free_block().
+
+static void umm_shrink_block( umm_heap *heap, umm_blockno c, umm_blockno blocks ) {
+
+   umm_blockno rest = c+blocks;
+
+   umm_make_new_block( heap, c, blocks, 0 );
+
+   DBG_LOG_DEBUG( "Freeing the last %6i blocks of block %6i\n", UMM_NBLOCK(rest) - rest, c );
+
+   UMM_STATS_USED( 0, UMM_NBLOCK(rest) - rest );
+
+   UMM_FREELIST_CHANGED();
+
+   umm_assimilate_up( heap, rest );
+
+   umm_connect_to_free_list( heap, rest );
+
+   if( 0 == UMM_NBLOCK(UMM_NBLOCK(rest) & UMM_BLOCKNO_MASK) )
+      umm_merge_into_end( heap, rest );
+   else
+      UMM_POISON( rest );
+}
+
+// ----------------------------------------------------------------------------
+// With UMM_CRITICAL_BUDGET a long scan of the free list does not keep the
+// critical section for all of its length. Every UMM_CRITICAL_STEPS entries
+// umm_critical_yield() leaves the critical section and enters it again right
+// away, which gives interrupts and other tasks a chance to get in. It then
+// returns 1 if the free list was changed in the meantime, and the scan has to
+// start over because the entry it was looking at may have been allocated or
+// merged with another one.
+//
+// A scan that had to start over UMM_CRITICAL_RESTARTS times keeps the
+// critical section until it is done, so a busy heap can't starve it.
+//
+// Only a plain umm_malloc() may yield. umm_realloc(), the cache, the bulk
+// allocator, umm_memalign() and umm_halloc() all scan while something of
+// their own is only half done - realloc() has already merged the next free
+// block into the one it is growing, for example. Someone freeing the
+// neighbour meanwhile would leave two free blocks next to each other.
+//
+// This only works because the critical section is never nested - if the
+// caller held it more than once, leaving it once would not let anyone in.
+// ----------------------------------------------------------------------------
+
+#if defined UMM_CRITICAL_BUDGET && !defined UMM_SEGREGATED_FIT
+
+typedef struct umm_critical_budget_t {
+   unsigned int steps;
+   unsigned int restarts;
+} umm_critical_budget;
+
+static int umm_critical_yield( umm_heap *heap, umm_critical_budget *budget ) {
+
+   unsigned int generation;
+
+   if( ++budget->steps < UMM_CRITICAL_STEPS )
+      return( 0 );
+
+   budget->steps = 0;
+
+   if( budget->restarts >= UMM_CRITICAL_RESTARTS )
+      return( 0 );
+
+   generation = heap->generation;
+
+   UMM_HEAP_CRITICAL_EXIT(heap);
+   UMM_HEAP_CRITICAL_ENTRY(heap);
+
+   if( generation == heap->generation )
+      return( 0 );
+
+   DBG_LOG_DEBUG( "Free list changed during the scan, start over\n" );
+
+   ++budget->restarts;
+
+   return( 1 );
+}
+
+#endif
+
+// ----------------------------------------------------------------------------
+// umm_malloc_placed() is umm_malloc_blocks() with a hint about how long the
+// block is going to live (see umm_malloc_lifetime()), or 0 for no hint. The
+// scan may only leave the critical section with UMM_CRITICAL_BUDGET when
+// yield is set.
+
+static umm_blockno umm_malloc_placed( umm_heap *heap, umm_blockno blocks, int lifetime, int yield ) {
+
+   /* volatile --COMMENTED BY DFRANK because the version from FreeRTOS doesn't have it*/
+   umm_blockno blockSize = 0;
+
+#ifndef UMM_SEGREGATED_FIT
+   umm_blockno bestSize;
+   umm_blockno start;
+   umm_blockno stop;
+   umm_blockno last = 0;
+   umm_blockno largest;
+
+   // Where a block is split - with UMM_ADDRESS_ORDERED the allocation is
+   // taken from the front, otherwise from the end of the free block
+
+#ifdef UMM_ADDRESS_ORDERED
+   int front = 1;
+#else
+   int front = 0;
+#endif
+#endif
+   umm_blockno bestBlock;
+
+   umm_blockno cf;
+
+#if defined UMM_CRITICAL_BUDGET && !defined UMM_SEGREGATED_FIT
+   umm_critical_budget budget = { 0, 0 };
+#else
+   (void)yield;
+#endif
+
+#ifdef UMM_PROFILE
+   heap->visited = 0;
+#endif
+
+   // Now we can scan through the free list until we find a space that's big
+   // enough to hold the number of blocks we need.
+   //
+   // This part may be customized to be a best-fit, worst-fit, or first-fit
+   // algorithm
+
+#ifdef UMM_SEGREGATED_FIT
+   // The size class lists hold every free block except the last one in the
+   // heap, which is the only entry left on the free list at block 0.
+
+   if( (bestBlock = umm_bin_search( heap, blocks )) ) {
+      cf        = bestBlock;
+      blockSize = (UMM_NBLOCK(cf) & UMM_BLOCKNO_MASK) - cf;
+   } else {
+      cf        = UMM_NFREE(0);
+   }
+#else
+   if( blocks > heap->freeMax ) {
+      // Nothing on the free list is big enough, so only the end of the heap
+      // can help. This is also how the static heap gets initialized.
+
+      cf = heap->top;
+   } else {
+      // Next fit starts where the last search ended. When it runs into the
+      // last block of the heap it goes on at the head of the list and stops
+      // where it started - stop is 0 until then.
+
+      cf = UMM_NFREE(0);
+
+      if( (UMM_FIT_NEXT == heap->fit) && heap->rover )
+         cf = heap->rover;
+
+      start   = cf;
+      stop    = 0;
+      largest = 0;
+
+      bestBlock = UMM_NFREE(0);
+      bestSize  = UMM_BLOCKNO_MASK;
+
+      while( 1 ) {
+         // A scan that gets all the way through the list has seen the
+         // largest free block, so the bound can be made exact
+
+         if( 0 == UMM_NFREE(cf) ) {
+            last = cf;
+
+            if( stop || (start == UMM_NFREE(0)) ) {
+               heap->freeMax = largest;
+               break;
+            }
+
+            stop = start;
+            cf   = UMM_NFREE(0);
+         }
+
+         if( cf == stop ) {
+            heap->freeMax = largest;
+            cf = last;
+            break;
+         }
+
+         blockSize = (UMM_NBLOCK(cf) & UMM_BLOCKNO_MASK) - cf;
+
+         DBG_LOG_TRACE( "Looking at block %6i size %6i\n", cf, blockSize );
+
+         UMM_PROFILE_VISIT();
+
+         if( blockSize > largest )
+            largest = blockSize;
+
+         if( lifetime ) {
+            // Short lived blocks go as low in the heap as they can, long
+            // lived ones as high
+
+            if( (blockSize >= blocks) &&
+                ( (UMM_BLOCKNO_MASK == bestSize) ||
+                  ((UMM_SHORT_LIVED == lifetime) ? (cf < bestBlock) : (cf > bestBlock)) ) ) {
+               bestBlock = cf;
+               bestSize  = blockSize;
+            }
+         } else if( UMM_FIT_BEST != heap->fit ) {
+            // This is the first block that fits!
+            if( (blockSize >= blocks) )
+               break;
+         } else if( (blockSize >= blocks) && (blockSize < bestSize) ) {
+            bestBlock = cf;
+            bestSize  = blockSize;
+         }
+
+         cf = UMM_NFREE(cf);
+
+#ifdef UMM_CRITICAL_BUDGET
+         // Let others in every now and then - if they changed the free list
+         // while we weren't looking, cf may not even be free any more
+
+         if( yield && umm_critical_yield( heap, &budget ) ) {
+            cf      = UMM_NFREE(0);
+            start   = cf;
+            stop    = 0;
+            largest = 0;
+
+            bestBlock = UMM_NFREE(0);
+            bestSize  = UMM_BLOCKNO_MASK;
+         }
+#endif
+      }
+
+      if( UMM_BLOCKNO_MASK != bestSize ) {
+         cf        = bestBlock;
+         blockSize = bestSize;
+      }
+
+      // The next search goes on after this block, or at the head of the
+      // list if this one is the end of the heap which is about to move
+
+      heap->rover = (UMM_NBLOCK(cf) & UMM_BLOCKNO_MASK) ? UMM_NFREE(cf) : 0;
+   }
+#endif
+
+   if( UMM_NBLOCK(cf) & UMM_BLOCKNO_MASK ) {
+      // This is an existing block in the memory heap, we just need to split off
+      // what we need, unlink it from the free list and mark it as in use, and
+      // link the rest of the block back into the freelist as if it was a new
+      // block on the free list...
+
+      if( blockSize == blocks ) {
+         // It's an exact fit and we don't neet to split off a block.
+         DBG_LOG_DEBUG( "Allocating %6i blocks starting at %6i - exact\n", blocks, cf );
+
+         // Disconnect this block from the FREE list
+
+         umm_disconnect_from_free_list( heap, cf );
+
+      } else {
+         // It's not an exact fit and we need to split off a block.
+         DBG_LOG_DEBUG( "Allocating %6i blocks starting at %6i - existing\n", blocks, cf );
+
+#ifdef UMM_SEGREGATED_FIT
+         // What is left over may belong to a smaller size class
+
+         umm_disconnect_from_free_list( heap, cf );
+
+         if( UMM_SHORT_LIVED == lifetime ) {
+            umm_make_new_block( heap, cf, blocks, 0 );
+
+            umm_connect_to_free_list( heap, cf+blocks );
+
+            UMM_POISON( cf+blocks );
+         } else {
+            umm_make_new_block( heap, cf, blockSize-blocks, 0 );
+
+            umm_connect_to_free_list( heap, cf );
+
+            cf += blockSize-blocks;
+         }
+#else
+         if( lifetime )
+            front = (UMM_SHORT_LIVED == lifetime);
+
+         if( front ) {
+            // Take the front of the block, so that the allocation stays low
+            // in the heap, and let the rest take its place in the free
+            // list - it still sits between the same two free blocks
+
+            UMM_STATS_FREE( blockSize, -1 );
+
+            umm_make_new_block( heap, cf, blocks, 0 );
+
+            UMM_NBLOCK(cf+blocks) |= UMM_FREELIST_MASK;
+            UMM_NFREE(cf+blocks)   = UMM_NFREE(cf);
+            UMM_PFREE(cf+blocks)   = UMM_PFREE(cf);
+
+            UMM_NFREE(UMM_PFREE(cf)) = cf+blocks;
+            UMM_PFREE(UMM_NFREE(cf)) = cf+blocks;
+
+            UMM_POISON( cf+blocks );
+
+            UMM_STATS_FREE( blockSize-blocks, 1 );
+         } else {
+            UMM_STATS_FREE( blockSize, -1 );
+
+            umm_make_new_block( heap, cf, blockSize-blocks, UMM_FREELIST_MASK );
+
+            UMM_STATS_FREE( blockSize-blocks, 1 );
+
+            cf += blockSize-blocks;
+         }
+#endif
+      }
+   } else {
+      // We're at the end of the heap - allocate a new block, but check to see if
+      // there's enough memory left for the requested block! Actually, we may need
+      // one more than that if we're initializing the umm_heap for the first
+      // time, which happens in the next conditional...
+
+#if defined(UMM_MALLOC_CFG__HEAP_SIZE) && !defined(UMM_TEST_MAIN)
+      // Now check to see if we need to initialize the free list...this assumes
+      // that the BSS is set to 0 on startup. We should rarely get to the end of
+      // the free list so this is the "cheapest" place to put the initialization!
+      //
+      // Heaps that are not the static array are always set up by umm_init(),
+      // so they don't need this check at all. The static array gets the same
+      // treatment, so that its blocks are aligned just like any other heap.
+
+      if( 0 == cf ) {
+         DBG_LOG_DEBUG( "Initializing malloc free block pointer\n" );
+         umm_init_heap( heap, umm_heap_space, sizeof(umm_heap_space), 1 );
+         cf            = 1;
+
+         // Unlike any other region, this one is known to be all zeros
+
+         heap->pristine = 2;
+      }
+#endif
+
+      if( UMM_NUMBLOCKS <= cf+blocks+1 ) {
+         DBG_LOG_DEBUG(  "Can't allocate %5i blocks at %5i\n", blocks, cf );
+
+         return( 0 );
+      }
+
+      if( UMM_LONG_LIVED == lifetime ) {
+         // A long lived block goes to the very top of the heap instead, and
+         // the last block moves up right behind it. What was the end of the
+         // heap is now an ordinary free block, and short lived blocks and
+         // the long lived ones that follow eat into it from either side.
+
+         umm_blockno end = UMM_NUMBLOCKS-1;
+         umm_blockno top = end-blocks;
+
+         DBG_LOG_DEBUG( "Allocating %6i blocks starting at %6i - top     \n", blocks, top );
+
+         UMM_NFREE(UMM_PFREE(cf)) = end;
+
+         memcpy( &UMM_BLOCK(end), &UMM_BLOCK(cf), sizeof(umm_block) );
+
+         UMM_PBLOCK(end) = top;
+         UMM_NBLOCK(top) = end;
+         UMM_PBLOCK(top) = cf;
+         UMM_NBLOCK(cf)  = top;
+
+#ifndef UMM_SEGREGATED_FIT
+         if( cf == heap->rover )
+            heap->rover = 0;
+
+         heap->top = end;
+#endif
+
+         umm_connect_to_free_list( heap, cf );
+
+         UMM_POISON( cf );
+
+         heap->pristine = UMM_NUMBLOCKS;
+
+         cf = top;
+      } else {
+         DBG_LOG_DEBUG( "Allocating %6i blocks starting at %6i - new     \n", blocks, cf );
+
+         UMM_NFREE(UMM_PFREE(cf)) = cf+blocks;
+
+         memcpy( &UMM_BLOCK(cf+blocks), &UMM_BLOCK(cf), sizeof(umm_block) );
+
+         UMM_NBLOCK(cf)           = cf+blocks;
+         UMM_PBLOCK(cf+blocks)    = cf;
+
+#ifndef UMM_SEGREGATED_FIT
+         if( cf == heap->rover )
+            heap->rover = 0;
+
+         heap->top = cf+blocks;
+#endif
+
+         if( heap->pristine <= cf+blocks )
+            heap->pristine = cf+blocks+1;
+      }
+   }
+
+   UMM_STATS_USED( blocks, 0 );
+
+   UMM_FREELIST_CHANGED();
+
+   UMM_SEAL( cf );
+
+   return( cf );
+}
+
+static umm_blockno umm_malloc_blocks( umm_heap *heap, umm_blockno blocks ) {
+   return( umm_malloc_placed( heap, blocks, 0, 0 ) );
+}
+
+// ----------------------------------------------------------------------------
+
+#ifdef UMM_CACHE
+
+// The small object caches sit in front of the heap. Each cache has a list
+// of blocks for every size from 1 to UMM_CACHE_MAX_BLOCKS, and the blocks on
+// these lists are still marked as used as far as the heap is concerned. They
+// are linked through the next free index in the body of the block, just like
+// the blocks on the free list, so the caches don't need any extra memory.
+//
+// The caller's cache is picked and protected with UMM_CACHE_ID() and
+// UMM_CACHE_ENTRY()/UMM_CACHE_EXIT(), which only have to keep other users
+// of the SAME cache away - typically by doing nothing at all for a per-task
+// cache, or by disabling interrupts on the current core for a per-core one.
+// The heap critical section is only taken to move half a magazine of
+// UMM_CACHE_DEPTH blocks at a time between a cache and the heap, and never
+// while the cache itself is locked.
+
+static umm_blockno umm_cache_pop( umm_heap *heap, umm_blockno blocks ) {
+
+   umm_cache *cache;
+
+   umm_blockno c;
+   umm_blockno b;
+   umm_blockno batch = 0;
+
+   int n;
+
+   if( blocks > UMM_CACHE_MAX_BLOCKS )
+      return( 0 );
+
+   UMM_CACHE_ENTRY();
+
+   cache = &heap->cache[UMM_CACHE_ID()];
+
+   if( (c = cache->head[blocks-1]) ) {
+      cache->head[blocks-1] = UMM_NFREE(c);
+      --cache->count[blocks-1];
+   }
+
+   UMM_CACHE_EXIT();
+
+   if( c )
+      return( c );
+
+   // The cache is empty, so allocate half a magazine in one go - we keep
+   // the first block for ourselves and put the rest in the cache
+
+   UMM_HEAP_CRITICAL_ENTRY(heap);
+
+   if( (c = umm_malloc_blocks( heap, blocks )) ) {
+      for( n = 1; n < UMM_CACHE_DEPTH/2; ++n ) {
+         if( 0 == (b = umm_malloc_blocks( heap, blocks )) )
+            break;
+
+         UMM_NFREE(b) = batch;
+         batch        = b;
+      }
+   }
+
+   UMM_HEAP_CRITICAL_EXIT(heap);
+
+   if( batch ) {
+      UMM_CACHE_ENTRY();
+
+      cache = &heap->cache[UMM_CACHE_ID()];
+
+      while( batch ) {
+         b     = batch;
+         batch = UMM_NFREE(b);
+
+         UMM_NFREE(b)          = cache->head[blocks-1];
+         cache->head[blocks-1] = b;
+         ++cache->count[blocks-1];
+      }
+
+      UMM_CACHE_EXIT();
+   }
+
+   return( c );
+}
+
+// ----------------------------------------------------------------------------
+
+static int umm_cache_push( umm_heap *heap, umm_blockno c ) {
+
+   umm_cache *cache;
+
+   umm_blockno blocks = (UMM_NBLOCK(c) & UMM_BLOCKNO_MASK) - c;
+
+   umm_blockno b;
+   umm_blockno spill = 0;
+
+   int n;
+
+   if( blocks > UMM_CACHE_MAX_BLOCKS )
+      return( 0 );
+
+   UMM_CACHE_ENTRY();
+
+   cache = &heap->cache[UMM_CACHE_ID()];
+
+   UMM_NFREE(c)          = cache->head[blocks-1];
+   cache->head[blocks-1] = c;
+
+   // When the magazine is full, keep the half that was freed most recently
+   // and give the rest back to the heap
+
+   if( ++cache->count[blocks-1] >= UMM_CACHE_DEPTH ) {
+      for( b = c, n = 1; n < UMM_CACHE_DEPTH/2; ++n )
+         b = UMM_NFREE(b);
+
+      spill        = UMM_NFREE(b);
+      UMM_NFREE(b) = 0;
+
+      cache->count[blocks-1] = UMM_CACHE_DEPTH/2;
+   }
+
+   UMM_CACHE_EXIT();
+
+   if( spill ) {
+      UMM_HEAP_CRITICAL_ENTRY(heap);
+
+      while( spill ) {
+         b     = spill;
+         spill = UMM_NFREE(b);
+
+         umm_free_block( heap, b );
+      }
+
+      UMM_HEAP_CRITICAL_EXIT(heap);
+   }
+
+   return( 1 );
+}
+
+// ----------------------------------------------------------------------------
+
+void umm_cache_flush_h( umm_heap *heap ) {
+
+   umm_cache *cache;
+
+   umm_blockno b;
+   umm_blockno spill[UMM_CACHE_MAX_BLOCKS];
+
+   int i;
+
+   // Take everything out of the cache of the caller...
+
+   UMM_CACHE_ENTRY();
+
+   cache = &heap->cache[UMM_CACHE_ID()];
+
+   for( i = 0; i < UMM_CACHE_MAX_BLOCKS; ++i ) {
+      spill[i]        = cache->head[i];
+      cache->head[i]  = 0;
+      cache->count[i] = 0;
+   }
+
+   UMM_CACHE_EXIT();
+
+   // ... and give it back to the heap
+
+   UMM_HEAP_CRITICAL_ENTRY(heap);
+
+   for( i = 0; i < UMM_CACHE_MAX_BLOCKS; ++i ) {
+      while( spill[i] ) {
+         b        = spill[i];
+         spill[i] = UMM_NFREE(b);
+
+         umm_free_block( heap, b );
+      }
+   }
+
+   UMM_HEAP_CRITICAL_EXIT(heap);
+}
+
+void umm_cache_flush( void ) {
+   umm_cache_flush_h( &umm_default_heap );
+}
+
+#endif
+
+// ----------------------------------------------------------------------------
+// umm_owns_h() only checks that ptr is somewhere in the blocks of the heap,
+// which is all it takes to find out which of several heaps (or allocators)
+// a pointer belongs to.
+//
+// umm_pointer_block() goes further and returns the block that ptr is the
+// data of, or 0 if ptr is not the data of a used block of the heap. It has
+// to point to the start of the data of a block, the block must not be free,
+// and the blocks before and after it must link back to it. That catches
+// most bad pointers and double frees without walking the heap. Blocks in a
+// cache or on the deferred list look just like used blocks, though.
+//
+// The caller of umm_pointer_block() must be in the critical section, so
+// that the neighbours of the block don't change under it - umm_valid_h()
+// takes care of that.
+// ----------------------------------------------------------------------------
+
+int umm_owns_h( umm_heap *heap, void *ptr ) {
+   return( ((char *)ptr >= (char *)&UMM_DATA(1)) &&
+           ((char *)ptr <  (char *)&UMM_BLOCK(UMM_NUMBLOCKS)) );
+}
+
+int umm_owns( void *ptr ) {
+   return( umm_owns_h( &umm_default_heap, ptr ) );
+}
+
+// ----------------------------------------------------------------------------
+
+static umm_blockno umm_pointer_block( umm_heap *heap, void *ptr ) {
+
+   umm_blockno c;
+   umm_blockno n;
+
+   if( !umm_owns_h( heap, ptr ) )
+      return( 0 );
+
+   if( ((char *)ptr - (char *)&UMM_DATA(0)) % sizeof(umm_block) )
+      return( 0 );
+
+   c = ((char *)ptr - (char *)&UMM_DATA(0)) / sizeof(umm_block);
+   n = UMM_NBLOCK(c);
+
+   if( (n & UMM_FREELIST_MASK) || (n <= c) || (n >= UMM_NUMBLOCKS) || (UMM_PBLOCK(n) != c) )
+      return( 0 );
+
+   if( (UMM_PBLOCK(c) >= c) || ((UMM_NBLOCK(UMM_PBLOCK(c)) & UMM_BLOCKNO_MASK) != c) )
+      return( 0 );
+
+   return( c );
+}
+
+// ----------------------------------------------------------------------------
+
+int umm_valid_h( umm_heap *heap, void *ptr ) {
+
+   umm_blockno c;
+
+   // Protect the critical section...
+   //
+   UMM_HEAP_CRITICAL_ENTRY(heap);
+
+   c = umm_pointer_block( heap, ptr );
+
+   // Release the critical section...
+   //
+   UMM_HEAP_CRITICAL_EXIT(heap);
+
+   return( 0 != c );
+}
+
+int umm_valid( void *ptr ) {
+   return( umm_valid_h( &umm_default_heap, ptr ) );
+}
+
+// ----------------------------------------------------------------------------
+// umm_check_step() checks the next few blocks of the block chain, starting
+// where the last call stopped, and returns the number of problems it found.
+// Each of them is passed to UMM_HEAP_CORRUPT() as well. At the end of the
+// heap it starts over at the bottom, so calling it now and then from an idle
+// task keeps checking the whole heap without ever holding the critical
+// section for long.
+//
+// Every block must link to a block above it that links back, and every free
+// block must be linked back by the next entry of its free list. On top of
+// that the check value of used blocks is checked with UMM_INTEGRITY, and the
+// poison of free blocks with UMM_POISON_FREE.
+// ----------------------------------------------------------------------------
+
+unsigned int umm_check_step_h( umm_heap *heap, unsigned int blocks ) {
+
+   umm_blockno c;
+   umm_blockno n;
+
+   unsigned int bad = 0;
+
+   // Protect the critical section...
+   //
+   UMM_HEAP_CRITICAL_ENTRY(heap);
+
+   // An uninitialized static heap has nothing to check yet
+
+   if( 0 == UMM_NBLOCK(0) )
+      blocks = 0;
+
+   while( blocks-- ) {
+      c = heap->scrub;
+      n = UMM_NBLOCK(c) & UMM_BLOCKNO_MASK;
+
+      if( 0 == n ) {
+         // The end of the heap, start over next time
+
+         heap->scrub = 0;
+         break;
+      }
+
+      if( (n <= c) || (n >= UMM_NUMBLOCKS) || (UMM_PBLOCK(n) != c) ) {
+         DBG_LOG_ERROR( "Block %6i does not link to the block after it\n", c );
+
+         UMM_HEAP_CORRUPT( heap, c );
+
+         // There is no telling where the next block is, so start over
+
+         ++bad;
+         heap->scrub = 0;
+         break;
+      }
+
+      if( 0 == c ) {
+         // Block 0 is just the head of the free list
+      } else if( UMM_NBLOCK(c) & UMM_FREELIST_MASK ) {
+         if( (UMM_NFREE(c) >= UMM_NUMBLOCKS) ||
+             (UMM_NFREE(c) && (UMM_PFREE(UMM_NFREE(c)) != c)) ) {
+            DBG_LOG_ERROR( "Free block %6i is not linked back by the free list\n", c );
+
+            UMM_HEAP_CORRUPT( heap, c );
+
+            ++bad;
+         } else if( !UMM_POISONED( c ) ) {
+            ++bad;
+         }
+      } else if( !UMM_SEALED( c ) ) {
+         ++bad;
+      }
+
+      heap->scrub = n;
+   }
+
+   // Release the critical section...
+   //
+   UMM_HEAP_CRITICAL_EXIT(heap);
+
+   return( bad );
+}
+
+unsigned int umm_check_step( unsigned int blocks ) {
+   return( umm_check_step_h( &umm_default_heap, blocks ) );
+}
+
+// ----------------------------------------------------------------------------
+
+void umm_free_h( umm_heap *heap, void *ptr ) {
+
+   umm_blockno c;
+
+   // If we're being asked to free a NULL pointer, well that's just silly!
+
+   if( (void *)0 == ptr ) {
+      DBG_LOG_DEBUG( "free a null pointer -> do nothing\n" );
+
+      return;
+   }
+
+   UMM_PROFILE_BEGIN( 'f' );
+
+   // With UMM_CHECK_POINTERS anything that is not a used block of this heap
+   // is refused (see umm_pointer_block()), otherwise we simply trust the
+   // caller.
+
+   // Figure out which block we're in. Note the use of truncated division...
+
+   c = (ptr-(void *)(&UMM_BLOCK(0)))/sizeof(umm_block);
+
+#ifdef UMM_CACHE
+#ifdef UMM_CHECK_POINTERS
+   // The cache doesn't take the critical section of the heap, but the check
+   // has to
+
+   if( !umm_valid_h( heap, ptr ) ) {
+      UMM_REFUSE_POINTER( "free", ptr );
+      UMM_PROFILE_END( 'f', 0 );
+
+      return;
+   }
+#endif
+
+#ifdef UMM_INTEGRITY
+   // A block that is corrupt is left alone, freeing it would only spread
+   // the damage. The check looks at the next block, which the heap may be
+   // changing right now, so it needs the critical section as well
+
+   UMM_HEAP_CRITICAL_ENTRY(heap);
+
+   if( !UMM_SEALED( c ) ) {
+      UMM_PROFILE_END( 'f', 0 );
+
+      // Release the critical section...
+      //
+      UMM_HEAP_CRITICAL_EXIT(heap);
+
+      return;
+   }
+
+   UMM_HEAP_CRITICAL_EXIT(heap);
+#endif
+
+#ifdef UMM_TRACE
+   // The free has to be in the trace before anyone else can get the block,
+   // and the cache doesn't take the critical section of the heap
+
+   if( heap->trace ) {
+      UMM_HEAP_CRITICAL_ENTRY(heap);
+      UMM_TRACE_PUT( 'f', 0, c, 0 );
+      UMM_HEAP_CRITICAL_EXIT(heap);
+   }
+#endif
+
+   // Small blocks go to the cache of the caller if there is room
+
+   if( umm_cache_push( heap, c ) ) {
+      UMM_PROFILE_END( 'f', 0 );
+
+      return;
+   }
+#endif
+
+   // Protect the critical section...
+   //
+   UMM_HEAP_CRITICAL_ENTRY(heap);
+
+#if defined UMM_CHECK_POINTERS && !defined UMM_CACHE
+   if( !umm_pointer_block( heap, ptr ) ) {
+      UMM_PROFILE_END( 'f', 0 );
+
+      // Release the critical section...
+      //
+      UMM_HEAP_CRITICAL_EXIT(heap);
+
+      UMM_REFUSE_POINTER( "free", ptr );
+
+      return;
+   }
+#endif
+
+#ifndef UMM_CACHE
+   if( !UMM_SEALED( c ) ) {
+      UMM_PROFILE_END( 'f', 0 );
+
+      // Release the critical section...
+      //
+      UMM_HEAP_CRITICAL_EXIT(heap);
+
+      return;
+   }
+
+   UMM_TRACE_PUT( 'f', 0, c, 0 );
+#endif
+
+   umm_free_block( heap, c );
+
+   UMM_STATS_INC( frees );
+
+   UMM_PROFILE_END( 'f', 0 );
+
+   // Release the critical section...
+   //
+   UMM_HEAP_CRITICAL_EXIT(heap);
+}
+
+void umm_free( void *ptr ) {
+   umm_free_h( &umm_default_heap, ptr );
+}
+
+// ----------------------------------------------------------------------------
+// With UMM_DEFERRED_FREE, umm_free_deferred() only pushes the block onto a
+// list of blocks that are waiting to be freed. The list is linked through
+// the next free index in the body of each block, which is not used while the
+// block is allocated, and the head is swapped in with UMM_DEFERRED_CAS(), so
+// it never takes the critical section and can be called from an interrupt
+// handler.
+//
+// The next umm_malloc() or umm_flush_deferred() takes the whole list in one
+// go and frees the blocks in the critical section it needs anyways. Blocks
+// are only ever pushed one at a time and taken all at once, so the list
+// can't suffer from the ABA problem.
+// ----------------------------------------------------------------------------
+
+#ifdef UMM_DEFERRED_FREE
+
+void umm_free_deferred_h( umm_heap *heap, void *ptr ) {
+
+   umm_blockno c;
+   umm_blockno head;
+
+   if( (void *)0 == ptr ) {
+      DBG_LOG_DEBUG( "free deferred a null pointer -> do nothing\n" );
+
+      return;
+   }
+
+#ifdef UMM_CHECK_POINTERS
+   // Only the cheap part of the check can be done here, the rest happens
+   // when the block is really freed
+
+   if( !umm_owns_h( heap, ptr ) || (((char *)ptr - (char *)&UMM_DATA(0)) % sizeof(umm_block)) ) {
+      UMM_REFUSE_POINTER( "free deferred", ptr );
+
+      return;
+   }
+#endif
+
+   c = (ptr-(void *)(&UMM_BLOCK(0)))/sizeof(umm_block);
+
+   do {
+      head         = heap->deferred;
+      UMM_NFREE(c) = head;
+   } while( !UMM_DEFERRED_CAS( &heap->deferred, head, c ) );
+}
+
+void umm_free_deferred( void *ptr ) {
+   umm_free_deferred_h( &umm_default_heap, ptr );
+}
+
+// ----------------------------------------------------------------------------
+// Free all the blocks on the deferred list - the caller must be in the
+// critical section
+
+static void umm_free_deferred_blocks( umm_heap *heap ) {
+
+   umm_blockno c;
+
+   do {
+      c = heap->deferred;
+   } while( c && !UMM_DEFERRED_CAS( &heap->deferred, c, 0 ) );
+
+   while( c ) {
+      umm_blockno next = UMM_NFREE(c);
+
+      DBG_LOG_DEBUG( "Freeing deferred block %6i\n", c );
+
+#ifdef UMM_CHECK_POINTERS
+      if( !umm_pointer_block( heap, (void *)&UMM_DATA(c) ) ) {
+         UMM_REFUSE_POINTER( "free deferred", (void *)&UMM_DATA(c) );
+
+         c = next;
+         continue;
+      }
+#endif
+
+      if( !UMM_SEALED( c ) ) {
+         c = next;
+         continue;
+      }
+
+      UMM_TRACE_PUT( 'f', 0, c, 0 );
+
+      umm_free_block( heap, c );
+
+      UMM_STATS_INC( frees );
+
+      c = next;
+   }
+}
+
+// ----------------------------------------------------------------------------
+
+void umm_flush_deferred_h( umm_heap *heap ) {
+
+   if( 0 == heap->deferred )
+      return;
+
+   // Protect the critical section...
+   //
+   UMM_HEAP_CRITICAL_ENTRY(heap);
+
+   umm_free_deferred_blocks( heap );
+
+   // Release the critical section...
+   //
+   UMM_HEAP_CRITICAL_EXIT(heap);
+}
+
+void umm_flush_deferred( void ) {
+   umm_flush_deferred_h( &umm_default_heap );
+}
+
+#endif
+
+// ----------------------------------------------------------------------------
+// umm_malloc_lifetime() is umm_malloc() with a hint about how long the block
+// is going to live. Short lived blocks (UMM_SHORT_LIVED) go to the lowest
+// free block that fits and take the front of it, long lived ones
+// (UMM_LONG_LIVED) go to the highest free block and take its end - the first
+// one of them is even put at the very top of the heap. That keeps the two
+// kinds apart, and the free space between them in one piece, instead of
+// long lived blocks getting stuck between short lived ones.
+//
+// Finding the lowest or highest block takes a scan of the whole free list,
+// like best fit does. With UMM_SEGREGATED_FIT the size classes pick the
+// block as usual, and only where it is split follows the hint. Long lived
+// blocks never come from a cache with UMM_CACHE.
+// ----------------------------------------------------------------------------
+
+static void *umm_malloc_sized( umm_heap *heap, umm_blockno blocks, size_t size, int lifetime ) {
+
+   umm_blockno cf;
+
+   // The size in bytes is only needed for the trace
+
+   (void)size;
+
+   UMM_PROFILE_BEGIN( 'm' );
+
+#ifdef UMM_CACHE
+   // Small blocks come from the cache of the caller if possible
+
+   if( (UMM_LONG_LIVED != lifetime) && (cf = umm_cache_pop( heap, blocks )) ) {
+#ifdef UMM_TRACE
+      if( heap->trace ) {
+         UMM_HEAP_CRITICAL_ENTRY(heap);
+         UMM_TRACE_PUT( 'm', 0, cf, size );
+         UMM_HEAP_CRITICAL_EXIT(heap);
+      }
+#endif
+      UMM_PROFILE_END( 'm', 0 );
+
+      return( (void *)&UMM_DATA(cf) );
+   }
+#endif
+
+   // Protect the critical section...
+   //
+   UMM_HEAP_CRITICAL_ENTRY(heap);
+
+#ifdef UMM_DEFERRED_FREE
+   // Whatever was freed from an interrupt meanwhile goes back to the heap
+   // first, so the allocation can use it
+
+   if( heap->deferred )
+      umm_free_deferred_blocks( heap );
+#endif
+
+   if( (cf = umm_malloc_placed( heap, blocks, lifetime, 1 )) )
+      UMM_STATS_INC( allocs );
+   else
+      UMM_STATS_INC( allocFails );
+
+   UMM_TRACE_PUT( 'm', 0, cf, size );
+
+   UMM_PROFILE_END( 'm', UMM_PROFILE_VISITED() );
+
+   // Release the critical section...
+   //
+   UMM_HEAP_CRITICAL_EXIT(heap);
+
+   return( cf ? (void *)&UMM_DATA(cf) : (void *)NULL );
+}
+
+void *umm_malloc_lifetime_h( umm_heap *heap, size_t size, int lifetime ) {
+
+   // the very first thing we do is figure out if we're being asked to allocate
+   // a size of 0 - and if we are we'll simply return a null pointer. if not
+   // then reduce the size by 1 byte so that the subsequent calculations on
+   // the number of blocks to allocate are easier...
+
+   if( 0 == size ) {
+      DBG_LOG_DEBUG( "malloc a block of 0 bytes -> do nothing\n" );
+
+      return( (void *)NULL );
+   }
+
+   return( umm_malloc_sized( heap, umm_blocks( size ), size, lifetime ) );
+}
+
+void *umm_malloc_lifetime( size_t size, int lifetime ) {
+   return( umm_malloc_lifetime_h( &umm_default_heap, size, lifetime ) );
+}
+
+// ----------------------------------------------------------------------------
+
+void *umm_malloc_h( umm_heap *heap, size_t size ) {
+   return( umm_malloc_lifetime_h( heap, size, 0 ) );
+}
+
+void *umm_malloc( size_t size ) {
+   return( umm_malloc_h( &umm_default_heap, size ) );
+}
+
+// ----------------------------------------------------------------------------
+// umm_malloc_const_h() is the back end of UMM_MALLOC_CONST(), which has
+// already checked the size and turned it into blocks at compile time, so
+// this goes straight to the cache or the free list.
+// ----------------------------------------------------------------------------
+
+void *umm_malloc_const_h( umm_heap *heap, umm_blockno blocks, size_t size ) {
+   return( umm_malloc_sized( heap, blocks, size, 0 ) );
+}
+
+// ----------------------------------------------------------------------------
+// umm_calloc() allocates num objects of size bytes that are cleared to 0.
+//
+// The heap remembers the first block that has never been written to since
+// the heap was set up (heap->pristine), which only ever moves up as the end
+// of the heap does. Whatever part of the new block lies past it doesn't have
+// to be cleared, which saves clearing most of a big block that is carved
+// from the end of a fresh heap.
+//
+// That only applies to the static heap of UMM_MALLOC_CFG__HEAP_SIZE when it
+// is set up by its first umm_malloc(), because it's in the BSS and known to
+// be all zeros. umm_init() knows nothing about the memory it's given - even
+// if it's the static array - so it puts heap->pristine at the end of the
+// heap and everything is cleared. The same happens when UMM_LONG_LIVED puts
+// a block at the very top of the heap. The calloc check of the test main
+// covers both cases.
+//
+// The value is read before the block is allocated and without the critical
+// section, but that's fine - it can only have moved up since, so at worst a
+// little more than necessary is cleared.
+// ----------------------------------------------------------------------------
+
+void *umm_calloc_h( umm_heap *heap, size_t num, size_t size ) {
+
+   umm_blockno pristine;
+
+   void *ptr;
+
+   char *fresh;
+
+   if( size && (num > (size_t)-1 / size) ) {
+      DBG_LOG_DEBUG( "calloc %lu objects of %lu bytes -> too big\n", (unsigned long)num, (unsigned long)size );
+
+      return( (void *)NULL );
+   }
+
+   size *= num;
+
+   pristine = heap->pristine;
+
+   if( (ptr = umm_malloc_h( heap, size )) ) {
+      fresh = (char *)&UMM_BLOCK(pristine);
+
+      if( (char *)ptr < fresh )
+         UMM_CALLOC_ZERO( ptr, ((size_t)(fresh - (char *)ptr) < size) ? (size_t)(fresh - (char *)ptr) : size );
+   }
+
+   return( ptr );
+}
+
+void *umm_calloc( size_t num, size_t size ) {
+   return( umm_calloc_h( &umm_default_heap, num, size ) );
+}
+
+// ----------------------------------------------------------------------------
+// umm_malloc_bulk() allocates count objects of the same size in a single
+// critical section and puts them into ptrs. It first tries to get one block
+// that is big enough for all of them, and cuts it into consecutive blocks
+// that are just like the ones umm_malloc() would return. If there is no such
+// block, the objects are allocated one at a time.
+//
+// The return value is the number of objects that could be allocated, the
+// rest of ptrs is set to NULL.
+//
+// umm_free_bulk() frees the blocks in ptrs, again in a single critical
+// section. NULL pointers in ptrs are fine.
+// ----------------------------------------------------------------------------
+
+unsigned int umm_malloc_bulk_h( umm_heap *heap, size_t size, unsigned int count, void **ptrs ) {
+
+   umm_blockno blocks;
+
+   umm_blockno cf;
+
+   unsigned int n = 0;
+
+   if( (0 == size) || (0 == count) ) {
+      DBG_LOG_DEBUG( "malloc bulk of 0 bytes or 0 objects -> do nothing\n" );
+
+      memset( ptrs, 0, count * sizeof(*ptrs) );
+
+      return( 0 );
+   }
+
+   blocks = umm_blocks( size );
+
+   // Protect the critical section...
+   //
+   UMM_HEAP_CRITICAL_ENTRY(heap);
+
+#ifdef UMM_DEFERRED_FREE
+   if( heap->deferred )
+      umm_free_deferred_blocks( heap );
+#endif
+
+   if( (count > 1) && (blocks <= UMM_BLOCKNO_MASK / count) &&
+       (cf = umm_malloc_blocks( heap, blocks * count )) ) {
+
+      DBG_LOG_DEBUG( "Cutting %i objects of %i blocks out of block %6i\n", count, blocks, cf );
+
+      for( n = 0; n < count; ++n ) {
+         if( n < count-1 )
+            umm_make_new_block( heap, cf, blocks, 0 );
+
+         UMM_SEAL( cf );
+
+         ptrs[n] = (void *)&UMM_DATA(cf);
+
+         UMM_TRACE_PUT( 'm', 0, cf, size );
+
+         cf += blocks;
+      }
+   } else {
+      for( n = 0; n < count; ++n ) {
+         if( 0 == (cf = umm_malloc_blocks( heap, blocks )) )
+            break;
+
+         ptrs[n] = (void *)&UMM_DATA(cf);
+
+         UMM_TRACE_PUT( 'm', 0, cf, size );
+      }
+   }
+
+#ifdef UMM_STATS
+   heap->stats.allocs += n;
+
+   if( n < count )
+      UMM_STATS_INC( allocFails );
+#endif
+
+   // Release the critical section...
+   //
+   UMM_HEAP_CRITICAL_EXIT(heap);
+
+   if( n < count )
+      memset( ptrs + n, 0, (count - n) * sizeof(*ptrs) );
+
+   return( n );
+}
+
+unsigned int umm_malloc_bulk( size_t size, unsigned int count, void **ptrs ) {
+   return( umm_malloc_bulk_h( &umm_default_heap, size, count, ptrs ) );
+}
+
+// ----------------------------------------------------------------------------
+
+void umm_free_bulk_h( umm_heap *heap, void **ptrs, unsigned int count ) {
+
+   umm_blockno c;
+
+   unsigned int n;
+
+   // Protect the critical section...
+   //
+   UMM_HEAP_CRITICAL_ENTRY(heap);
+
+   for( n = 0; n < count; ++n ) {
+      if( (void *)0 == ptrs[n] )
+         continue;
+
+#ifdef UMM_CHECK_POINTERS
+      if( !umm_pointer_block( heap, ptrs[n] ) ) {
+         UMM_REFUSE_POINTER( "free bulk", ptrs[n] );
+         continue;
+      }
+#endif
+
+      c = (ptrs[n]-(void *)(&UMM_BLOCK(0)))/sizeof(umm_block);
+
+      if( !UMM_SEALED( c ) )
+         continue;
+
+      UMM_TRACE_PUT( 'f', 0, c, 0 );
+
+      umm_free_block( heap, c );
+
+      UMM_STATS_INC( frees );
+   }
+
+   // Release the critical section...
+   //
+   UMM_HEAP_CRITICAL_EXIT(heap);
+}
+
+void umm_free_bulk( void **ptrs, unsigned int count ) {
+   umm_free_bulk_h( &umm_default_heap, ptrs, count );
+}
+
+// ----------------------------------------------------------------------------
+// umm_memalign() returns a block whose data starts on a multiple of
+// alignment, which must be a power of two.
+//
+// The data of every block is aligned to the size of a block (see
+// umm_init_h()), so anything up to that comes for free. For bigger
+// alignments we allocate enough extra blocks that one of the first few
+// blocks has its data on the boundary, and that's where the new block
+// starts. The leading fragment and anything that is left over at the end go
+// back to the free list:
+//
+//    +----+--------+-----------------------+----------+
+//    | cf |  ...   | c                     |   rest   |
+//    +----+--------+-----------------------+----------+
+//    |<- freed  ->|<-  blocks requested  ->|<- freed ->|
+//
+// The result is an ordinary block that is given back with umm_free(). Note
+// that umm_realloc() keeps the alignment only as long as it does not have to
+// move the data.
+// ----------------------------------------------------------------------------
+
+void *umm_memalign_h( umm_heap *heap, size_t alignment, size_t size ) {
+
+   umm_blockno blocks;
+   umm_blockno slack;
+   umm_blockno end;
+
+   umm_blockno cf;
+   umm_blockno c;
+
+   if( (0 == alignment) || (alignment & (alignment - 1)) ) {
+      DBG_LOG_DEBUG( "memalign to %lu bytes -> not a power of two\n", (unsigned long)alignment );
+
+      return( (void *)NULL );
+   }
+
+   if( 0 == size ) {
+      DBG_LOG_DEBUG( "memalign a block of 0 bytes -> do nothing\n" );
+
+      return( (void *)NULL );
+   }
+
+   blocks = umm_blocks( size );
+   slack  = (alignment - 1) / sizeof(umm_block);
+
+   if( slack >= UMM_BLOCKNO_MASK - blocks ) {
+      DBG_LOG_DEBUG( "memalign %lu bytes to %lu bytes -> too big\n", (unsigned long)size, (unsigned long)alignment );
+
+      return( (void *)NULL );
+   }
+
+   // Protect the critical section...
+   //
+   UMM_HEAP_CRITICAL_ENTRY(heap);
+
+   if( (cf = umm_malloc_blocks( heap, blocks + slack )) ) {
+      end = UMM_NBLOCK(cf) & UMM_BLOCKNO_MASK;
+
+      for( c = cf; c <= cf + slack; ++c ) {
+         if( 0 == ((uintptr_t)&UMM_DATA(c) & (alignment - 1)) )
+            break;
+      }
+
+      if( c > cf + slack ) {
+         // This can only happen if the heap itself is not aligned well
+         // enough, in which case no block ever will be
+
+         DBG_LOG_DEBUG( "Can't align block %6i to %lu bytes\n", cf, (unsigned long)alignment );
+
+         umm_free_block( heap, cf );
+
+         c = 0;
+      } else {
+         DBG_LOG_DEBUG( "Aligned %6i blocks at %6i to %lu bytes\n", blocks, c, (unsigned long)alignment );
+
+         // Split off the leading fragment first, so that c is a block of
+         // its own, and then the rest at the end...
+
+         if( c > cf )
+            umm_make_new_block( heap, cf, c - cf, 0 );
+
+         if( c + blocks < end )
+            umm_make_new_block( heap, c, blocks, 0 );
+
+         // ... and free them now that the block in the middle is in use
+
+         if( c + blocks < end )
+            umm_free_block( heap, c + blocks );
+
+         if( c > cf )
+            umm_free_block( heap, cf );
+
+         UMM_SEAL( c );
+      }
+   } else {
+      c = 0;
+   }
+
+   if( c )
+      UMM_STATS_INC( allocs );
+   else
+      UMM_STATS_INC( allocFails );
+
+   // An aligned block replays just fine as an ordinary one
+
+   UMM_TRACE_PUT( 'm', 0, c, size );
+
+   // Release the critical section...
+   //
+   UMM_HEAP_CRITICAL_EXIT(heap);
+
+   return( c ? (void *)&UMM_DATA(c) : (void *)NULL );
+}
+
+void *umm_memalign( size_t alignment, size_t size ) {
+   return( umm_memalign_h( &umm_default_heap, alignment, size ) );
+}
+
+// ----------------------------------------------------------------------------
+
+void *umm_realloc_h( umm_heap *heap, void *ptr, size_t size ) {
+
+   umm_blockno blocks;
+   umm_blockno blockSize;
+   umm_blockno oldBlocks;
+
+   umm_blockno c;
+
+#ifdef UMM_TRACE
+   umm_blockno oldBlock;
+#endif
+
+   size_t curSize;
+
+   // This code looks after the case of a NULL value for ptr. The ANSI C
+   // standard says that if ptr is NULL and size is non-zero, then we've
+   // got to work the same a malloc(). If size is also 0, then our version
+   // of malloc() returns a NULL pointer, which is OK as far as the ANSI C
+   // standard is concerned.
+
+   if( ((void *)NULL == ptr) ) {
+      DBG_LOG_DEBUG( "realloc the NULL pointer - call malloc()\n" );
+
+      return( umm_malloc_h(heap, size) );
+   }
+
+   // Now we're sure that we have a non_NULL ptr, but we're not sure what
+   // we should do with it. If the size is 0, then the ANSI C standard says that
+   // we should operate the same as free.
+
+   if( 0 == size ) {
+      DBG_LOG_DEBUG( "realloc to 0 size, just free the block\n" );
+
+      umm_free_h( heap, ptr );
+
+      return( (void *)NULL );
+   }
+
+   // The two cases above are profiled as umm_malloc() and umm_free()
+
+   UMM_PROFILE_BEGIN( 'r' );
+
+   // Protect the critical section...
+   //
+   UMM_HEAP_CRITICAL_ENTRY(heap);
+
+#ifdef UMM_PROFILE
+   heap->visited = 0;
+#endif
+
+#ifdef UMM_CHECK_POINTERS
+   if( !umm_pointer_block( heap, ptr ) ) {
+      UMM_PROFILE_END( 'r', 0 );
+
+      // Release the critical section...
+      //
+      UMM_HEAP_CRITICAL_EXIT(heap);
+
+      UMM_REFUSE_POINTER( "realloc", ptr );
+
+      return( (void *)NULL );
+   }
+#endif
+
+   // Otherwise we need to actually do a reallocation. A naiive approach
+   // would be to malloc() a new block of the correct size, copy the old data
+   // to the new block, and then free the old block.
+   //
+   // While this will work, we end up doing a lot of possibly unnecessary
+   // copying. So first, let's figure out how many blocks we'll need.
+
+   blocks = umm_blocks( size );
+
+   // Figure out which block we're in. Note the use of truncated division...
+
+   c = (ptr-(void *)(&UMM_BLOCK(0)))/sizeof(umm_block);
+
+#ifdef UMM_TRACE
+   oldBlock = c;
+#endif
+
+   // A block that is corrupt is left alone
+
+   if( !UMM_SEALED( c ) ) {
+      UMM_PROFILE_END( 'r', 0 );
+
+      // Release the critical section...
+      //
+      UMM_HEAP_CRITICAL_EXIT(heap);
+
+      return( (void *)NULL );
+   }
+
+   // Figure out how big this block is...
+
+   blockSize = (UMM_NBLOCK(c) - c);
+   oldBlocks = blockSize;
+
+   // Figure out how many bytes are in this block
+
+   curSize   = (blockSize*sizeof(umm_block))-(sizeof(((umm_block *)0)->header));
+
+   // Ok, now that we're here, we know the block number of the original chunk
+   // of memory, and we know how much new memory we want, and we know the original
+   // block size...
+
+   if( blockSize == blocks ) {
+      // This space intentionally left blank - return the original pointer!
+
+      DBG_LOG_DEBUG( "realloc the same size block - %i, do nothing\n", blocks );
+
+      UMM_TRACE_PUT( 'r', c, c, size );
+
+      UMM_PROFILE_END( 'r', 0 );
+
+      // Release the critical section...
+      //
+      UMM_HEAP_CRITICAL_EXIT(heap);
+
+      return( ptr );
+   }
+
+   // Now we have a block size that could be bigger or smaller. Either
+   // way, try to assimilate up to the next block before doing anything...
+   //
+   // If it's still too small, we have to free it anyways and it will save the
+   // assimilation step later in free :-)
+
+   umm_assimilate_up( heap, c );
+
+   blockSize = (UMM_NBLOCK(c) - c);
+
+   // If the block is still too small, try to grow it where it is before we
+   // resort to copying everything to a new block. The best case is a block
+   // that is followed by the end of the heap, because it can simply take as
+   // much of the unused space there as it needs.
+   //
+   // Otherwise check if it might help to assimilate down, but don't actually
+   // do the downward assimilation unless the resulting block will hold the
+   // new request - either on its own, or because it can then grow into the
+   // end of the heap. If this block of code runs, then the new block will
+   // either fit the request exactly, or be larger than the request.
+
+   if( (blockSize < blocks) &&
+       (0 == UMM_NBLOCK(UMM_NBLOCK(c))) && (UMM_NUMBLOCKS > c+blocks+1) ) {
+
+      DBG_LOG_DEBUG( "realloc() grows %i blocks into the end of the heap\n", blocks-blockSize );
+
+      umm_grow_into_end( heap, c, blocks );
+
+      UMM_STATS_INC( reallocEnd );
+
+   } else if( (UMM_NBLOCK(UMM_PBLOCK(c)) & UMM_FREELIST_MASK) &&
+              ( (blocks <= (UMM_NBLOCK(c)-UMM_PBLOCK(c))) ||
+                ((0 == UMM_NBLOCK(UMM_NBLOCK(c))) && (UMM_NUMBLOCKS > UMM_PBLOCK(c)+blocks+1)) ) ) {
+
+      DBG_LOG_DEBUG( "realloc() could assimilate down %i blocks - fits!\n\r", c-UMM_PBLOCK(c) );
+
+      // Disconnect the previous block from the FREE list
+
+      umm_disconnect_from_free_list( heap, UMM_PBLOCK(c) );
+
+      // Connect the previous block to the next block ... and then
+      // realign the current block pointer
+
+      c = umm_assimilate_down(heap, c, 0);
+
+      // Move the bytes down to the new block we just created, but be sure to move
+      // only the original bytes.
+
+      memmove( (void *)&UMM_DATA(c), ptr, curSize );
+
+      // And don't forget to adjust the pointer to the new block location!
+
+      ptr    = (void *)&UMM_DATA(c);
+
+      if( (UMM_NBLOCK(c) - c) < blocks )
+         umm_grow_into_end( heap, c, blocks );
+
+      if( blocks > oldBlocks )
+         UMM_STATS_INC( reallocDown );
+   } else if( (blocks > oldBlocks) && (blockSize >= blocks) ) {
+      UMM_STATS_INC( reallocUp );
+   }
+
+   // Now calculate the block size again...and we'll have three cases
+
+   blockSize = (UMM_NBLOCK(c) - c);
+
+   UMM_STATS_USED( blockSize, oldBlocks );
+
+   if( blockSize == blocks ) {
+      // This space intentionally left blank - return the original pointer!
+
+      DBG_LOG_DEBUG( "realloc the same size block - %i, do nothing\n", blocks );
+
+   } else if (blockSize > blocks ) {
+      // New block is smaller than the old block, so just make a new block
+      // at the end of this one and put it up on the free list...
+
+      DBG_LOG_DEBUG( "realloc %i to a smaller block %i, shrink and free the leftover bits\n", blockSize, blocks );
+
+      umm_shrink_block( heap, c, blocks );
+   } else {
+      // New block is bigger than the old block...
+
+      umm_blockno cf;
+
+      DBG_LOG_DEBUG( "realloc %i to a bigger block %i, make new, copy, and free the old\n", blockSize, blocks );
+
+      // Now allocate a new one, copy the old data to the new block, and
+      // free up the old block, but only if the malloc was sucessful! We are
+      // already in the critical section, so we use the internal functions
+      // that work on block numbers directly.
+
+      if( (cf = umm_malloc_blocks( heap, blocks )) ) {
+         memcpy( (void *)&UMM_DATA(cf), ptr, curSize );
+
+         umm_free_block( heap, c );
+
+         ptr = (void *)&UMM_DATA(cf);
+
+         UMM_STATS_INC( reallocCopy );
+      } else {
+         // The old block must stay valid, but give back whatever we may
+         // have assimilated from the next block
+
+         if( blockSize > oldBlocks )
+            umm_shrink_block( heap, c, oldBlocks );
+
+         ptr = (void *)NULL;
+
+         UMM_STATS_INC( reallocFail );
+         UMM_STATS_INC( allocFails );
+      }
+   }
+
+   UMM_SEAL( ptr ? (ptr-(void *)(&UMM_BLOCK(0)))/sizeof(umm_block) : c );
+
+   UMM_TRACE_PUT( 'r', oldBlock, ptr ? (ptr-(void *)(&UMM_BLOCK(0)))/sizeof(umm_block) : 0, size );
+
+   UMM_PROFILE_END( 'r', UMM_PROFILE_VISITED() );
+
+   // Release the critical section...
+   //
+   UMM_HEAP_CRITICAL_EXIT(heap);
+
+   return( ptr );
+}
+
+void *umm_realloc( void *ptr, size_t size ) {
+   return( umm_realloc_h( &umm_default_heap, ptr, size ) );
+}
+
+// ----------------------------------------------------------------------------
+// umm_usable_size() returns the number of bytes that really fit in the block
+// at ptr, which is at least what was asked for. All of them can be used, so
+// a buffer that grows can fill up its block before it needs umm_realloc().
+// It only looks at the block itself, so it doesn't need the critical
+// section.
+//
+// umm_good_size() returns what umm_usable_size() would return for a block of
+// size bytes, so a caller can ask for exactly that much in the first place.
+// Sizes that no heap could hold are returned as they are.
+// ----------------------------------------------------------------------------
+
+size_t umm_usable_size_h( umm_heap *heap, void *ptr ) {
+
+   umm_blockno c;
+
+   if( (void *)NULL == ptr )
+      return( 0 );
+
+   c = (ptr-(void *)(&UMM_BLOCK(0)))/sizeof(umm_block);
+
+   return( umm_block_bytes( UMM_NBLOCK(c) - c ) );
+}
+
+size_t umm_usable_size( void *ptr ) {
+   return( umm_usable_size_h( &umm_default_heap, ptr ) );
+}
+
+size_t umm_good_size( size_t size ) {
+
+   umm_blockno blocks;
+
+   if( 0 == size )
+      return( 0 );
+
+   blocks = umm_blocks( size );
+
+   if( UMM_BLOCKNO_MASK == blocks )
+      return( size );
+
+   return( umm_block_bytes( blocks ) );
+}
+
+// ----------------------------------------------------------------------------
+// Fixed size object pools
+//
+// A pool is one chunk of memory from umm_malloc() that starts with the pool
+// descriptor and is followed by count objects of the same size. The free
+// objects are kept on a stack that is linked through the first word of each
+// object, so there is no per object overhead at all and both umm_pool_alloc()
+// and umm_pool_free() take constant time.
+//
+// The object size is rounded up so that every object can hold the link
+// pointer and stays aligned like the chunk itself.
+//
+//    +------+------+------+-- ... --+------+
+//    | pool | obj0 | obj1 |         | objN |
+//    +------+------+------+-- ... --+------+
+//
+// The pool operations are protected by the critical section of the heap the
+// pool was created in.
+// ----------------------------------------------------------------------------
+
+struct umm_pool_t {
+   umm_heap           *heap;
+   void               *free;
+   char               *objs;
+   size_t              objSize;
+   unsigned short int  count;
+};
+
+// ----------------------------------------------------------------------------
+
+umm_pool *umm_pool_create_h( umm_heap *heap, size_t size, unsigned short int count ) {
+
+   umm_pool *pool;
+
+   char *obj;
+
+   unsigned short int i;
+
+   if( 0 == count )
+      return( (umm_pool *)NULL );
+
+   // Make room for the free stack link and keep the objects aligned, but a
+   // size that would wrap around when it's rounded up can't work at all
+
+   if( size > (size_t)-1 - (sizeof(void *) - 1) ) {
+      DBG_LOG_DEBUG( "umm_pool_create - objects of %lu bytes are too big\n", (unsigned long)size );
+      return( (umm_pool *)NULL );
+   }
+
+   if( size < sizeof(void *) )
+      size = sizeof(void *);
+
+   size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+   // Make sure that the chunk size doesn't overflow before asking the heap
+   // for it - the heap will fail the request if it's too big anyways
+
+   if( size > ((size_t)-1 - sizeof(umm_pool)) / count ) {
+      DBG_LOG_DEBUG( "umm_pool_create - %i objects of %lu bytes is too big\n", count, (unsigned long)size );
+      return( (umm_pool *)NULL );
+   }
+
+   if( !(pool = (umm_pool *)umm_malloc_h( heap, sizeof(umm_pool) + size*count )) ) {
+      DBG_LOG_DEBUG( "umm_pool_create - can't allocate %i objects of %lu bytes\n", count, (unsigned long)size );
+      return( (umm_pool *)NULL );
+   }
+
+   pool->heap    = heap;
+   pool->objs    = (char *)(pool + 1);
+   pool->objSize = size;
+   pool->count   = count;
+
+   // Push the objects on the free stack back to front, so that the first
+   // allocations come from the start of the chunk
+
+   pool->free = NULL;
+
+   for( i = count; i > 0; --i ) {
+      obj = pool->objs + (i-1)*size;
+
+      *(void **)obj = pool->free;
+      pool->free    = obj;
+   }
+
+   DBG_LOG_DEBUG( "umm_pool_create - %i objects of %lu bytes at %08lx\n", count, (unsigned long)size, (unsigned long)pool );
+
+   return( pool );
+}
+
+umm_pool *umm_pool_create( size_t size, unsigned short int count ) {
+   return( umm_pool_create_h( &umm_default_heap, size, count ) );
+}
+
+// ----------------------------------------------------------------------------
+
+void *umm_pool_alloc( umm_pool *pool ) {
+
+   void *ptr;
+
+   if( (umm_pool *)NULL == pool )
+      return( (void *)NULL );
+
+   // Protect the critical section...
+   //
+   UMM_HEAP_CRITICAL_ENTRY(pool->heap);
+
+   if( (ptr = pool->free) )
+      pool->free = *(void **)ptr;
+
+   // Release the critical section...
+   //
+   UMM_HEAP_CRITICAL_EXIT(pool->heap);
+
+   if( !ptr ) {
+      DBG_LOG_DEBUG( "umm_pool_alloc - pool at %08lx is empty\n", (unsigned long)pool );
+   }
+
+   return( ptr );
+}
+
+// ----------------------------------------------------------------------------
+
+void umm_pool_free( umm_pool *pool, void *ptr ) {
+
+   // If we're being asked to free a NULL pointer, well that's just silly!
+
+   if( (void *)0 == ptr ) {
+      DBG_LOG_DEBUG( "umm_pool_free a NULL pointer -> do nothing\n" );
+
+      return;
+   }
+
+   // The pointer has to be the start of one of the objects in the pool,
+   // anything else would corrupt the free stack
+
+   if( ((char *)ptr < pool->objs) ||
+       ((char *)ptr >= pool->objs + pool->count*pool->objSize) ||
+       (((char *)ptr - pool->objs) % pool->objSize) ) {
+      DBG_LOG_DEBUG( "umm_pool_free - %08lx is not an object of pool at %08lx\n", (unsigned long)ptr, (unsigned long)pool );
+
+      return;
+   }
+
+   // Protect the critical section...
+   //
+   UMM_HEAP_CRITICAL_ENTRY(pool->heap);
+
+   *(void **)ptr = pool->free;
+   pool->free    = ptr;
+
+   // Release the critical section...
+   //
+   UMM_HEAP_CRITICAL_EXIT(pool->heap);
+}
+
+// ----------------------------------------------------------------------------
+
+void umm_pool_destroy( umm_pool *pool ) {
+
+   // All the objects go back to the heap with the pool, so any object that
+   // is still in use becomes invalid
+
+   if( (umm_pool *)NULL != pool )
+      umm_free_h( pool->heap, pool );
+}
+
+// ----------------------------------------------------------------------------
+// Relocatable blocks and heap compaction
+//
+// With UMM_HANDLES a block can be allocated with umm_halloc(), which returns
+// a handle instead of a pointer. The handle is the index of an entry in the
+// handle table of the heap plus 1, so 0 is never a valid handle. The entry
+// holds the block number and a lock count, and umm_hlock() turns the handle
+// into a pointer that stays valid until the matching umm_hunlock().
+//
+// umm_compact() slides blocks that belong to a handle and are not locked
+// down over the free block right below them, which moves the free space up
+// towards the end of the heap where it merges into one big piece. Blocks
+// from umm_malloc() are never moved, because nobody could tell their owner.
+//
+// The compaction works its way up through the block chain from a cursor in
+// the heap context, and each call only looks at a few blocks, so it can be
+// run from an idle task without keeping the critical section for long. Any
+// code that makes a block disappear by merging it with another one has to
+// keep the cursor on the start of a block.
+// ----------------------------------------------------------------------------
+
+#ifdef UMM_HANDLES
+
+umm_handle umm_halloc_h( umm_heap *heap, size_t size ) {
+
+   umm_handle h;
+
+   umm_blockno cf = 0;
+
+   if( 0 == size ) {
+      DBG_LOG_DEBUG( "halloc a block of 0 bytes -> do nothing\n" );
+
+      return( 0 );
+   }
+
+   // Protect the critical section...
+   //
+   UMM_HEAP_CRITICAL_ENTRY(heap);
+
+   for( h = 0; h < UMM_HANDLE_COUNT; ++h ) {
+      if( 0 == heap->handles[h].block )
+         break;
+   }
+
+   if( h < UMM_HANDLE_COUNT ) {
+      if( (cf = umm_malloc_blocks( heap, umm_blocks( size ) )) ) {
+         heap->handles[h].block = cf;
+         heap->handles[h].locks = 0;
+
+         UMM_STATS_INC( allocs );
+      } else {
+         UMM_STATS_INC( allocFails );
+      }
+   } else {
+      DBG_LOG_DEBUG( "halloc - all %i handles are in use\n", UMM_HANDLE_COUNT );
+   }
+
+   // Release the critical section...
+   //
+   UMM_HEAP_CRITICAL_EXIT(heap);
+
+   return( cf ? h+1 : 0 );
+}
+
+umm_handle umm_halloc( size_t size ) {
+   return( umm_halloc_h( &umm_default_heap, size ) );
+}
+
+// ----------------------------------------------------------------------------
+
+void umm_hfree_h( umm_heap *heap, umm_handle h ) {
+
+   if( (0 == h) || (h > UMM_HANDLE_COUNT) ) {
+      DBG_LOG_DEBUG( "hfree an invalid handle %i -> do nothing\n", h );
+
+      return;
+   }
+
+   // Protect the critical section...
+   //
+   UMM_HEAP_CRITICAL_ENTRY(heap);
+
+   if( heap->handles[h-1].block && UMM_SEALED( heap->handles[h-1].block ) ) {
+      umm_free_block( heap, heap->handles[h-1].block );
+
+      heap->handles[h-1].block = 0;
+
+      UMM_STATS_INC( frees );
+   }
+
+   // Release the critical section...
+   //
+   UMM_HEAP_CRITICAL_EXIT(heap);
+}
+
+void umm_hfree( umm_handle h ) {
+   umm_hfree_h( &umm_default_heap, h );
+}
+
+// ----------------------------------------------------------------------------
+
+void *umm_hlock_h( umm_heap *heap, umm_handle h ) {
+
+   void *ptr = (void *)NULL;
+
+   if( (0 == h) || (h > UMM_HANDLE_COUNT) )
+      return( ptr );
+
+   // Protect the critical section...
+   //
+   UMM_HEAP_CRITICAL_ENTRY(heap);
+
+   if( heap->handles[h-1].block ) {
+      ++heap->handles[h-1].locks;
+
+      ptr = (void *)&UMM_DATA(heap->handles[h-1].block);
+   }
+
+   // Release the critical section...
+   //
+   UMM_HEAP_CRITICAL_EXIT(heap);
+
+   return( ptr );
+}
+
+void *umm_hlock( umm_handle h ) {
+   return( umm_hlock_h( &umm_default_heap, h ) );
+}
+
+// ----------------------------------------------------------------------------
+
+void umm_hunlock_h( umm_heap *heap, umm_handle h ) {
+
+   if( (0 == h) || (h > UMM_HANDLE_COUNT) )
+      return;
+
+   // Protect the critical section...
+   //
+   UMM_HEAP_CRITICAL_ENTRY(heap);
+
+   if( heap->handles[h-1].locks )
+      --heap->handles[h-1].locks;
+
+   // Release the critical section...
+   //
+   UMM_HEAP_CRITICAL_EXIT(heap);
+}
+
+void umm_hunlock( umm_handle h ) {
+   umm_hunlock_h( &umm_default_heap, h );
+}
+
+// ----------------------------------------------------------------------------
+// Move the used block n down over the free block f right below it. The data
+// goes first, then the block chain is put back together with the free space
+// after the moved block, which then goes through umm_free_block() so that it
+// is merged with whatever free space follows. It has to count as used for
+// that, or the stats would be off.
+
+static void umm_compact_move( umm_heap *heap, umm_blockno f, umm_blockno n ) {
+
+   umm_blockno size  = UMM_NBLOCK(n) - n;
+   umm_blockno after = UMM_NBLOCK(n);
+
+   DBG_LOG_DEBUG( "Compact - move %6i blocks from %6i down to %6i\n", size, n, f );
+
+   umm_disconnect_from_free_list( heap, f );
+
+   memmove( (void *)&UMM_DATA(f), (void *)&UMM_DATA(n),
+            size*sizeof(umm_block) - sizeof(((umm_block *)0)->header) );
+
+   UMM_NBLOCK(f)      = f+size;
+   UMM_NBLOCK(f+size) = after;
+   UMM_PBLOCK(f+size) = f;
+   UMM_PBLOCK(after)  = f+size;
+
+   UMM_STATS_USED( n-f, 0 );
+
+   UMM_SEAL( f );
+
+   UMM_CURSOR_MOVE( n, f );
+
+   umm_free_block( heap, f+size );
+}
+
+// ----------------------------------------------------------------------------
+// Do up to steps steps of the compaction. Each step moves the cursor past one
+// block, or moves one block down over the free block at the cursor. Returns
+// the number of blocks that were moved - when the cursor gets to the end of
+// the heap it starts over at the bottom.
+
+unsigned int umm_compact_h( umm_heap *heap, unsigned int steps ) {
+
+   umm_blockno c;
+   umm_blockno n;
+
+   unsigned int moved = 0;
+   int h;
+
+   // Protect the critical section...
+   //
+   UMM_HEAP_CRITICAL_ENTRY(heap);
+
+   // An uninitialized static heap has nothing to compact yet
+
+   if( 0 == UMM_NBLOCK(0) )
+      steps = 0;
+
+   while( steps-- ) {
+      c = heap->compact ? heap->compact : UMM_NBLOCK(0);
+      n = UMM_NBLOCK(c) & UMM_BLOCKNO_MASK;
+
+      if( (0 == n) || (0 == UMM_NBLOCK(n)) ) {
+         // The end of the heap, start over next time
+
+         heap->compact = 0;
+         break;
+      }
+
+      heap->compact = n;
+
+      // Only a free block followed by an unlocked block with a handle
+      // makes for a move
+
+      if( !(UMM_NBLOCK(c) & UMM_FREELIST_MASK) )
+         continue;
+
+      for( h = 0; h < UMM_HANDLE_COUNT; ++h ) {
+         if( n == heap->handles[h].block )
+            break;
+      }
+
+      if( (h == UMM_HANDLE_COUNT) || heap->handles[h].locks )
+         continue;
+
+      umm_compact_move( heap, c, n );
+
+      heap->handles[h].block = c;
+      heap->compact          = c;
+
+      ++moved;
+   }
+
+   // Release the critical section...
+   //
+   UMM_HEAP_CRITICAL_EXIT(heap);
+
+   return( moved );
+}
+
+unsigned int umm_compact( unsigned int steps ) {
+   return( umm_compact_h( &umm_default_heap, steps ) );
+}
+
+#endif
+
+// ----------------------------------------------------------------------------
+// Heaps that span several memory regions
+//
+// A part with several RAM banks that are not next to each other gets a heap
+// for each of them, and umm_region_add() puts them on a list in the order
+// they should be used in - usually the fastest bank first. Each region keeps
+// its own block chain in its own heap context, so a region can be as big as
+// any other heap, and the flags of the region tell what its memory is good
+// for, like UMM_FAST or UMM_DMA.
+//
+// umm_region_malloc() goes through the list and takes the first region that
+// has all the flags asked for and room for the block. With UMM_SPILL it goes
+// on to the other regions in list order when none of those has room, so a
+// request for fast memory ends up in slow memory rather than failing.
+//
+// umm_region_free() and umm_region_realloc() find the region a block belongs
+// to by its address (see umm_owns_h()), which takes a few compares per
+// region. After that everything happens in the heap of that region, under
+// its critical section.
+//
+// The region doesn't have to be zeroed before umm_region_add(), just like a
+// heap context for umm_init_h() - only the lock of its heap is kept.
+// ----------------------------------------------------------------------------
+
+static umm_region *umm_regions;
+
+void umm_region_add( umm_region *region, void *base, size_t len, unsigned int flags ) {
+
+   umm_region **last = &umm_regions;
+
+   umm_init_h( &region->heap, base, len );
+
+   region->flags = flags;
+   region->next  = (umm_region *)NULL;
+
+   while( *last )
+      last = &(*last)->next;
+
+   *last = region;
+}
+
+// ----------------------------------------------------------------------------
+
+static umm_region *umm_region_of( void *ptr ) {
+
+   umm_region *region;
+
+   for( region = umm_regions; region; region = region->next ) {
+      if( umm_owns_h( &region->heap, ptr ) )
+         break;
+   }
+
+   return( region );
+}
+
+umm_heap *umm_region_heap( void *ptr ) {
+
+   umm_region *region = umm_region_of( ptr );
+
+   return( region ? &region->heap : (umm_heap *)NULL );
+}
+
+// ----------------------------------------------------------------------------
+
+void *umm_region_malloc( size_t size, unsigned int flags ) {
+
+   umm_region *region;
+
+   unsigned int want = flags & ~UMM_SPILL;
+
+   void *ptr = (void *)NULL;
+
+   for( region = umm_regions; region && !ptr; region = region->next ) {
+      if( want == (region->flags & want) )
+         ptr = umm_malloc_h( &region->heap, size );
+   }
+
+   if( (flags & UMM_SPILL) && want ) {
+      for( region = umm_regions; region && !ptr; region = region->next ) {
+         if( want != (region->flags & want) )
+            ptr = umm_malloc_h( &region->heap, size );
+      }
+   }
+
+   return( ptr );
+}
+
+// ----------------------------------------------------------------------------
+
+void umm_region_free( void *ptr ) {
+
+   umm_heap *heap;
+
+   if( (heap = umm_region_heap( ptr )) ) {
+      umm_free_h( heap, ptr );
+   } else if( (void *)NULL != ptr ) {
+      DBG_LOG_ERROR( "region free - %08lx is not in any region\n", (unsigned long)ptr );
+   }
+}
+
+// ----------------------------------------------------------------------------
+// A block that can't grow where it is moves to another region with the same
+// flags as the one it is in, but only when its own region can't hold it.
+//
+// umm_realloc_h() returns NULL for a pointer it refuses as well, so the block
+// is checked first - only a used block that is intact (see umm_pointer_block()
+// and UMM_INTEGRITY) may move, anything else gets NULL in any build.
+
+static int umm_region_intact( umm_heap *heap, void *ptr ) {
+
+   umm_blockno c;
+
+   // Protect the critical section...
+   //
+   UMM_HEAP_CRITICAL_ENTRY(heap);
+
+   if( (c = umm_pointer_block( heap, ptr )) && !UMM_SEALED( c ) )
+      c = 0;
+
+   // Release the critical section...
+   //
+   UMM_HEAP_CRITICAL_EXIT(heap);
+
+   return( 0 != c );
+}
+
+void *umm_region_realloc( void *ptr, size_t size ) {
+
+   umm_region *owner;
+   umm_region *region;
+
+   size_t used;
+
+   void *moved = (void *)NULL;
+
+   if( (void *)NULL == ptr )
+      return( umm_region_malloc( size, UMM_SPILL ) );
+
+   if( !(owner = umm_region_of( ptr )) ) {
+      DBG_LOG_ERROR( "region realloc - %08lx is not in any region\n", (unsigned long)ptr );
+
+      return( (void *)NULL );
+   }
+
+   if( 0 == size ) {
+      umm_free_h( &owner->heap, ptr );
+
+      return( (void *)NULL );
+   }
+
+   if( !umm_region_intact( &owner->heap, ptr ) ) {
+      DBG_LOG_ERROR( "region realloc - %08lx is not a used block\n", (unsigned long)ptr );
+
+      return( (void *)NULL );
+   }
+
+   if( (moved = umm_realloc_h( &owner->heap, ptr, size )) )
+      return( moved );
+
+   for( region = umm_regions; region && !moved; region = region->next ) {
+      if( (region != owner) && (owner->flags == (region->flags & owner->flags)) )
+         moved = umm_malloc_h( &region->heap, size );
+   }
+
+   if( moved ) {
+      used = umm_usable_size_h( &owner->heap, ptr );
+
+      memcpy( moved, ptr, (used < size) ? used : size );
+
+      umm_free_h( &owner->heap, ptr );
+   }
+
+   return( moved );
+}
+
+// ----------------------------------------------------------------------------
+
+#ifdef UMM_TEST_MAIN
+
+// ----------------------------------------------------------------------------
+// The test main is a small benchmark suite. Each workload is a stream of
+// operations on a table of slots, generated by a private pseudo random number
+// generator with a fixed seed. So every run does exactly the same sequence of
+// allocations, whatever the build options are. That makes it possible to
+// compare UMM_FIRST_FIT against UMM_BEST_FIT, or against the segregated fits,
+// by building the file twice and running both.
+//
+// The workloads are:
+//
+//   mixed  - the original random realloc() test
+//   churn  - lots of small objects that come and go in random order
+//   fifo   - a producer/consumer queue of medium sized buffers
+//   grow   - buffers that grow with realloc() until they are dropped, mixed
+//            with small allocations
+//   trace  - the operations in the file named on the command line, one per
+//            line as "m slot size", "f slot" or "r slot size"
+//   replay - with -b file, the binary umm_trace_entry records that were
+//            read with umm_trace_read() on a device. The block numbers are
+//            the slots, so the heap here should be at least as big as the
+//            one on the device.
+//
+// With UMM_TRACE, -w file records the mixed workload into a binary trace
+// file, which is handy to check the replay.
+//
+// The cost of every call is measured with UMM_TEST_CYCLES() (see
+// umm_malloc_cfg.h). For each kind of call the report has the 50, 90 and 99
+// percentile and the worst case, and it shows the peak number of bytes in
+// use and the fragmentation of the heap at ten points during the workload.
+//
+// With UMM_TEST_THREADS, -t n runs the threads workload instead (see
+// umm_test_threads() below).
+// ----------------------------------------------------------------------------
+
+#include <stdlib.h>
+
+#if !defined UMM_TEST_CYCLES || defined UMM_TEST_THREADS
+#  include <time.h>
+
+static unsigned long umm_test_clock( void ) {
+
+   struct timespec ts;
+
+   clock_gettime( CLOCK_MONOTONIC, &ts );
+
+   return( ts.tv_sec * 1000000000UL + ts.tv_nsec );
+}
+#endif
+
+#ifndef UMM_TEST_CYCLES
+#  define UMM_TEST_CYCLES() umm_test_clock()
+#endif
+
+#define UMM_TEST_SLOTS   (256)
+#define UMM_TEST_HANDLES (32768)
+#define UMM_TEST_OPS     (200000)
+#define UMM_TEST_POINTS  (10)
+
+enum { UMM_TEST_MALLOC, UMM_TEST_FREE, UMM_TEST_REALLOC, UMM_TEST_KINDS };
+
+static const char *umm_test_kind[UMM_TEST_KINDS] = { "malloc", "free", "realloc" };
+
+// The result of the operation on slot goes to dest, which is the same slot
+// unless a replayed umm_realloc() moved the block
+
+typedef struct umm_test_op_t {
+   int    kind;
+   int    slot;
+   int    dest;
+   size_t size;
+} umm_test_op;
+
+static void          *umm_test_ptr[UMM_TEST_HANDLES];
+static size_t         umm_test_size[UMM_TEST_HANDLES];
+static unsigned char  umm_test_tag[UMM_TEST_HANDLES];
+
+static unsigned long umm_test_cost[UMM_TEST_KINDS][UMM_TEST_OPS];
+static long          umm_test_calls[UMM_TEST_KINDS];
+static long          umm_test_fails[UMM_TEST_KINDS];
+
+static unsigned char umm_test_next_tag;
+static long          umm_test_bad;
+
+static FILE *umm_test_file;
+
+// The fit that -f picked, umm_init() doesn't keep it
+
+static int umm_test_fit = UMM_FIT_DEFAULT;
+
+// ----------------------------------------------------------------------------
+// Every block gets a tag in its first and last byte, and the tag is checked
+// before the block is freed or reallocated. A block that was handed out
+// twice, or whose data umm_realloc() lost, counts as bad - so a broken
+// allocator can't get away with good numbers.
+
+static void umm_test_tag_set( int slot ) {
+
+   unsigned char *p = (unsigned char *)umm_test_ptr[slot];
+
+   if( p && umm_test_size[slot] ) {
+      umm_test_tag[slot] = ++umm_test_next_tag;
+
+      p[0] = p[umm_test_size[slot]-1] = umm_test_tag[slot];
+   }
+}
+
+static void umm_test_tag_check( int slot ) {
+
+   unsigned char *p = (unsigned char *)umm_test_ptr[slot];
+
+   if( p && umm_test_size[slot] &&
+       ((p[0] != umm_test_tag[slot]) || (p[umm_test_size[slot]-1] != umm_test_tag[slot])) )
+      ++umm_test_bad;
+}
+
+// ----------------------------------------------------------------------------
+// A 32 bit xorshift generator, so the workloads don't depend on the rand()
+// of the C library
+
+static unsigned long umm_test_seed;
+
+static unsigned long umm_test_rand( void ) {
+
+   umm_test_seed ^= (umm_test_seed << 13) & 0xFFFFFFFFUL;
+   umm_test_seed ^= (umm_test_seed >> 17);
+   umm_test_seed ^= (umm_test_seed <<  5) & 0xFFFFFFFFUL;
+
+   return( umm_test_seed );
+}
+
+// ----------------------------------------------------------------------------
+// The workload generators fill in the next operation and return 0 when the
+// workload is done.
+
+static int umm_test_mixed( long i, umm_test_op *op ) {
+
+   static const size_t sizes[16] = { 1, 1, 1, 1, 1, 1, 1, 40, 40, 100, 100, 100, 100, 200, 200, 400 };
+
+   op->kind = UMM_TEST_REALLOC;
+   op->slot = umm_test_rand() % UMM_TEST_SLOTS;
+
+   // The first seven cases are a realloc() to 0 bytes - which is a free
+
+   op->size = umm_test_rand() % 16;
+   op->size = (op->size < 7) ? 0 : umm_test_rand() % sizes[op->size];
+
+   return( i < UMM_TEST_OPS );
+}
+
+static int umm_test_churn( long i, umm_test_op *op ) {
+
+   op->slot = umm_test_rand() % UMM_TEST_SLOTS;
+
+   if( umm_test_ptr[op->slot] ) {
+      op->kind = UMM_TEST_FREE;
+   } else {
+      op->kind = UMM_TEST_MALLOC;
+      op->size = 1 + umm_test_rand() % 64;
+   }
+
+   return( i < UMM_TEST_OPS );
+}
+
+static int umm_test_fifo( long i, umm_test_op *op ) {
+
+   static long head;
+   static long tail;
+
+   if( 0 == i )
+      head = tail = 0;
+
+   // Produce a little more often than we consume, until the queue is full
+
+   if( (head - tail < UMM_TEST_SLOTS) && ((head == tail) || (umm_test_rand() % 8 < 5)) ) {
+      op->kind = UMM_TEST_MALLOC;
+      op->slot = head++ % UMM_TEST_SLOTS;
+      op->size = 16 + umm_test_rand() % 240;
    } else {
-      // We're at the end of the heap - allocate a new block, but check to see if
-      // there's enough memory left for the requested block! Actually, we may need
-      // one more than that if we're initializing the umm_heap for the first
-      // time, which happens in the next conditional...
+      op->kind = UMM_TEST_FREE;
+      op->slot = tail++ % UMM_TEST_SLOTS;
+   }
+
+   return( i < UMM_TEST_OPS );
+}
+
+static int umm_test_grow( long i, umm_test_op *op ) {
+
+   static size_t limit[8];
+
+   // Every fourth operation grows one of the first 8 slots by a bit, until it
+   // reaches its limit and is dropped - the rest are small allocations
+
+   if( 0 == i % 4 ) {
+      op->slot = umm_test_rand() % 8;
+
+      if( umm_test_size[op->slot] >= limit[op->slot] ) {
+         op->kind         = UMM_TEST_FREE;
+         limit[op->slot]  = 256 + umm_test_rand() % 1792;
+      } else {
+         op->kind = UMM_TEST_REALLOC;
+         op->size = umm_test_size[op->slot] + 8 + umm_test_rand() % 56;
+      }
+   } else {
+      op->slot = 8 + umm_test_rand() % (UMM_TEST_SLOTS - 8);
+
+      if( umm_test_ptr[op->slot] ) {
+         op->kind = UMM_TEST_FREE;
+      } else {
+         op->kind = UMM_TEST_MALLOC;
+         op->size = 1 + umm_test_rand() % 32;
+      }
+   }
+
+   return( i < UMM_TEST_OPS );
+}
+
+static int umm_test_trace( long i, umm_test_op *op ) {
+
+   char line[80];
+   char kind;
+
+   int slot;
+
+   unsigned long size;
+
+   // Skip anything that isn't a valid operation
+
+   while( (i < UMM_TEST_OPS) && fgets( line, sizeof(line), umm_test_file ) ) {
+      size = 0;
+
+      if( 2 > sscanf( line, " %c %d %lu", &kind, &slot, &size ) )
+         continue;
+
+      if( (slot < 0) || (slot >= UMM_TEST_HANDLES) )
+         continue;
+
+      op->slot = slot;
+      op->dest = slot;
+      op->size = size;
+
+      switch( kind ) {
+         case 'm': op->kind = UMM_TEST_MALLOC;  return( 1 );
+         case 'f': op->kind = UMM_TEST_FREE;    return( 1 );
+         case 'r': op->kind = UMM_TEST_REALLOC; return( 1 );
+      }
+   }
+
+   return( 0 );
+}
+
+#ifdef UMM_TRACE
+static int umm_test_replay( long i, umm_test_op *op ) {
+
+   umm_trace_entry entry;
+
+   // Like a text trace, a replay stops when the cost tables are full
+
+   while( (i < UMM_TEST_OPS) && (1 == fread( &entry, sizeof(entry), 1, umm_test_file )) ) {
+      if( (entry.ptr >= UMM_TEST_HANDLES) || (entry.old >= UMM_TEST_HANDLES) )
+         continue;
+
+      op->size = entry.size;
+
+      switch( entry.op ) {
+         case 'm': op->kind = UMM_TEST_MALLOC;
+                   op->slot = op->dest = entry.ptr;
+                   return( 1 );
+
+         case 'f': op->kind = UMM_TEST_FREE;
+                   op->slot = op->dest = entry.ptr;
+                   return( 1 );
+
+         // A failed umm_realloc() on the device left the block where it was
+
+         case 'r': op->kind = UMM_TEST_REALLOC;
+                   op->slot = entry.old;
+                   op->dest = (entry.ptr || !entry.size) ? entry.ptr : entry.old;
+                   return( 1 );
+      }
+   }
+
+   return( 0 );
+}
+
+static FILE *umm_test_record;
+
+static umm_trace_entry umm_test_trace_buffer[1024];
+
+static void umm_test_drain( void ) {
+
+   umm_trace_entry entries[256];
+
+   unsigned int n;
+
+   while( (n = umm_trace_read( entries, 256 )) )
+      fwrite( entries, sizeof(entries[0]), n, umm_test_record );
+}
+#endif
+
+// ----------------------------------------------------------------------------
+// The fragmentation is the percentage of the free blocks that are not part
+// of the largest free block. It's worked out by walking the heap so that it
+// works in any build, but of course not while the clock is running.
+
+static int umm_test_fragmentation( void ) {
+
+   umm_heap *heap = &umm_default_heap;
+
+   umm_blockno blockNo = UMM_NBLOCK(0) & UMM_BLOCKNO_MASK;
+
+   unsigned long freeBlocks = 0;
+   unsigned long largest    = 0;
+   unsigned long size;
+
+   if( 0 == blockNo )
+      return( 0 );
+
+   while( UMM_NBLOCK(blockNo) & UMM_BLOCKNO_MASK ) {
+      size = (UMM_NBLOCK(blockNo) & UMM_BLOCKNO_MASK) - blockNo;
+
+      if( UMM_NBLOCK(blockNo) & UMM_FREELIST_MASK ) {
+         freeBlocks += size;
+
+         if( size > largest )
+            largest = size;
+      }
+
+      blockNo = UMM_NBLOCK(blockNo) & UMM_BLOCKNO_MASK;
+   }
+
+   size        = UMM_NUMBLOCKS - blockNo;
+   freeBlocks += size;
+
+   if( size > largest )
+      largest = size;
+
+   return( 100 - (int)((largest * 100) / freeBlocks) );
+}
+
+// ----------------------------------------------------------------------------
+
+static int umm_test_compare( const void *a, const void *b ) {
+
+   unsigned long x = *(const unsigned long *)a;
+   unsigned long y = *(const unsigned long *)b;
+
+   return( (x > y) - (x < y) );
+}
+
+static void umm_test_run( const char *name, int (*next)( long i, umm_test_op *op ) ) {
+
+   umm_test_op op;
+
+   unsigned long start;
+   unsigned long cost;
+
+   unsigned long *samples;
+
+   int frag[UMM_TEST_POINTS];
+   int points = 0;
+
+   unsigned long live = 0;
+   unsigned long peak = 0;
+
+   void *ptr;
+
+   unsigned int problems;
+
+   long i;
+   long n;
+
+   int k;
+
+   // Every workload starts with an empty heap, the same seed and the same fit
+
+   umm_init( umm_heap_space, sizeof(umm_heap_space) );
+
+   umm_set_fit( umm_test_fit );
+
+#ifdef UMM_TRACE
+   // umm_init() drops any trace, so a recording starts only now
+
+   if( umm_test_record )
+      umm_trace_start( umm_test_trace_buffer, 1024 );
+#endif
+
+   memset( umm_test_ptr,   0, sizeof(umm_test_ptr)   );
+   memset( umm_test_size,  0, sizeof(umm_test_size)  );
+   memset( umm_test_calls, 0, sizeof(umm_test_calls) );
+   memset( umm_test_fails, 0, sizeof(umm_test_fails) );
+
+   umm_test_bad  = 0;
+   umm_test_seed = 2463534242UL;
+
+   for( i = 0; op.dest = -1, next( i, &op ); ++i ) {
+      if( op.dest < 0 )
+         op.dest = op.slot;
+
+      ptr = (void *)NULL;
+
+      umm_test_tag_check( op.slot );
+
+      switch( op.kind ) {
+         case UMM_TEST_MALLOC:
+            // A trace may allocate a slot that is still in use, so drop the
+            // old block first - that is not counted
+
+            umm_free( umm_test_ptr[op.slot] );
+
+            live -= umm_test_size[op.slot];
+
+            start = UMM_TEST_CYCLES();
+            ptr   = umm_malloc( op.size );
+            cost  = UMM_TEST_CYCLES() - start;
+
+            umm_test_ptr[op.slot]  = ptr;
+            umm_test_size[op.slot] = ptr ? op.size : 0;
+
+            umm_test_tag_set( op.slot );
+            break;
+
+         case UMM_TEST_FREE:
+            start = UMM_TEST_CYCLES();
+            umm_free( umm_test_ptr[op.slot] );
+            cost  = UMM_TEST_CYCLES() - start;
+
+            live -= umm_test_size[op.slot];
+
+            umm_test_ptr[op.slot]  = (void *)NULL;
+            umm_test_size[op.slot] = 0;
+            break;
+
+         default:
+            start = UMM_TEST_CYCLES();
+            ptr   = umm_realloc( umm_test_ptr[op.slot], op.size );
+            cost  = UMM_TEST_CYCLES() - start;
+
+            // A failed realloc() leaves the old block alone, and a
+            // successful one keeps at least its first byte
+
+            if( ptr && umm_test_size[op.slot] &&
+                (*(unsigned char *)ptr != umm_test_tag[op.slot]) )
+               ++umm_test_bad;
+
+            if( ptr || (0 == op.size) ) {
+               live -= umm_test_size[op.slot];
+
+               umm_test_ptr[op.slot]  = (void *)NULL;
+               umm_test_size[op.slot] = 0;
+
+               // Anything that is still in the destination slot of a replay
+               // was lost on the way, so drop it
+
+               if( op.dest != op.slot ) {
+                  live -= umm_test_size[op.dest];
+
+                  umm_test_tag_check( op.dest );
+                  umm_free( umm_test_ptr[op.dest] );
+               }
+
+               umm_test_ptr[op.dest]  = ptr;
+               umm_test_size[op.dest] = op.size;
+
+               umm_test_tag_set( op.dest );
+            }
+            break;
+      }
+
+      if( UMM_TEST_FREE != op.kind ) {
+         live += umm_test_size[op.dest];
+
+         if( live > peak )
+            peak = live;
+      }
+
+      if( (UMM_TEST_FREE != op.kind) && op.size && !ptr )
+         ++umm_test_fails[op.kind];
+
+      umm_test_cost[op.kind][umm_test_calls[op.kind]++] = cost;
+
+      if( (points < UMM_TEST_POINTS) && (0 == (i+1) % (UMM_TEST_OPS / UMM_TEST_POINTS)) )
+         frag[points++] = umm_test_fragmentation();
+
+#ifdef UMM_TRACE
+      if( umm_test_record && (0 == (i+1) % 512) )
+         umm_test_drain();
+#endif
+   }
+
+#ifdef UMM_TRACE
+   if( umm_test_record )
+      umm_test_drain();
+#endif
+
+   // Report the percentiles for each kind of call...
+
+   printf( "%-6s %8ld operations, peak %lu bytes in use\n", name, i, peak );
+
+   for( k = 0; k < UMM_TEST_KINDS; ++k ) {
+      if( 0 == (n = umm_test_calls[k]) )
+         continue;
+
+      samples = umm_test_cost[k];
+
+      qsort( samples, n, sizeof(samples[0]), umm_test_compare );
+
+      printf( "   %-7s %8ld calls %6ld fails   p50 %6lu   p90 %6lu   p99 %6lu   max %8lu\n",
+            umm_test_kind[k], n, umm_test_fails[k],
+            samples[n/2], samples[(n*9)/10], samples[(n*99)/100], samples[n-1] );
+   }
+
+   // ... and how the fragmentation developed
+
+   printf( "   fragmentation %%" );
+
+   for( k = 0; k < points; ++k )
+      printf( " %3d", frag[k] );
+
+   printf( "\n" );
+
+   // Give everything back and check that the heap is in one piece and
+   // really empty again
+
+   for( n = 0; n < UMM_TEST_HANDLES; ++n ) {
+      umm_test_tag_check( n );
+      umm_free( umm_test_ptr[n] );
+   }
+
+#ifdef UMM_CACHE
+   umm_cache_flush();
+#endif
+
+   problems = umm_check_step( umm_default_heap.numblocks );
+
+   umm_info( NULL, 0 );
+
+   printf( "   check %ld bad blocks, %u heap problems, %u blocks left in use%s\n",
+         umm_test_bad, problems, (unsigned int)heapInfo.usedBlocks,
+         (umm_test_bad || problems || heapInfo.usedBlocks) ? " - FAILED" : "" );
+}
+
+// ----------------------------------------------------------------------------
+// The calloc check makes sure umm_calloc() always hands out zeros, whether the
+// block is recycled, carved from the end of the heap or lies across the point
+// up to which the heap has ever been used. Every block is filled with ones
+// before it is freed, and so is a quarter of them that is taken with
+// umm_malloc() instead, so anything that umm_calloc() forgets to clear
+// shows up.
+//
+// It runs on a heap that is known to be all zeros, like the static heap on
+// its first umm_malloc() - that's the only case where the untouched part of
+// a block is not cleared, so the check also makes sure that it happened at
+// all - and on a heap that was set up by umm_init() on dirty memory.
+// ----------------------------------------------------------------------------
+
+#define UMM_TEST_CALLOC_SLOTS (64)
+#define UMM_TEST_CALLOC_OPS   (20000)
+
+static void umm_test_calloc( const char *name, int zeroed ) {
+
+   umm_heap *heap = &umm_default_heap;
+
+   unsigned char *ptr[UMM_TEST_CALLOC_SLOTS];
+   size_t         size[UMM_TEST_CALLOC_SLOTS];
+
+   umm_blockno pristine;
+
+   long calls = 0;
+   long fresh = 0;
+   long bad   = 0;
+
+   size_t k;
+   long   i;
+   int    slot;
+
+   memset( umm_heap_space, zeroed ? 0 : 0xff, sizeof(umm_heap_space) );
+
+   umm_init( umm_heap_space, sizeof(umm_heap_space) );
+
+   // This is what the first umm_malloc() of the static heap does
+
+   if( zeroed )
+      heap->pristine = 2;
+
+   memset( ptr, 0, sizeof(ptr) );
+
+   umm_test_seed = 2463534242UL;
+
+   for( i = 0; i < UMM_TEST_CALLOC_OPS; ++i ) {
+      slot = umm_test_rand() % UMM_TEST_CALLOC_SLOTS;
+
+      if( ptr[slot] ) {
+         memset( ptr[slot], 0xff, size[slot] );
+         umm_free( ptr[slot] );
+
+         ptr[slot] = (unsigned char *)NULL;
+         continue;
+      }
+
+      // Mostly small objects, and now and then one that takes a good part
+      // of the heap
+
+      size[slot] = (umm_test_rand() % 16) ? 1 + umm_test_rand() % 64 : 1 + umm_test_rand() % 4096;
+
+      if( 0 == umm_test_rand() % 4 ) {
+         if( (ptr[slot] = umm_malloc( size[slot] )) )
+            memset( ptr[slot], 0xff, size[slot] );
+         continue;
+      }
+
+      pristine = heap->pristine;
+
+      if( !(ptr[slot] = umm_calloc( 1, size[slot] )) )
+         continue;
+
+      ++calls;
+
+      if( (char *)ptr[slot] + size[slot] > (char *)&UMM_BLOCK(pristine) )
+         ++fresh;
+
+      for( k = 0; k < size[slot]; ++k ) {
+         if( ptr[slot][k] ) {
+            ++bad;
+            break;
+         }
+      }
+   }
+
+   for( slot = 0; slot < UMM_TEST_CALLOC_SLOTS; ++slot )
+      umm_free( ptr[slot] );
+
+   printf( "calloc %-6s %6ld calls, %ld partly untouched, %ld not cleared%s\n",
+         name, calls, fresh, bad, (bad || (zeroed && !fresh)) ? " - FAILED" : "" );
+}
+
+// ----------------------------------------------------------------------------
+// The pool check empties a pool and makes sure that every object is handed
+// out once and lies inside the pool, that a foreign or misaligned pointer is
+// refused by umm_pool_free(), and that sizes that can't work are refused by
+// umm_pool_create(). The heap must be empty again when the pool is gone.
+// ----------------------------------------------------------------------------
+
+#define UMM_TEST_POOL_COUNT (8)
+#define UMM_TEST_POOL_SIZE  (20)
+
+static void umm_test_pool( void ) {
+
+   char *obj[UMM_TEST_POOL_COUNT + 1];
+
+   umm_pool *pool;
+
+   char *foreign;
+
+   long bad = 0;
+
+   int i;
+   int k;
+
+   umm_init( umm_heap_space, sizeof(umm_heap_space) );
+
+   if( !(pool = umm_pool_create( UMM_TEST_POOL_SIZE, UMM_TEST_POOL_COUNT )) ) {
+      printf( "pool   can't create a pool - FAILED\n" );
+      return;
+   }
+
+   foreign = (char *)umm_malloc( UMM_TEST_POOL_SIZE );
+
+   // Empty the pool twice, and give back a foreign and a misaligned pointer
+   // along with the real objects in between
+
+   for( k = 0; k < 2; ++k ) {
+      for( i = 0; i <= UMM_TEST_POOL_COUNT; ++i )
+         obj[i] = (char *)umm_pool_alloc( pool );
+
+      if( obj[UMM_TEST_POOL_COUNT] )
+         ++bad;
+
+      for( i = 0; i < UMM_TEST_POOL_COUNT; ++i ) {
+         if( !obj[i] || (obj[i] < (char *)pool) || (i && (obj[i] != obj[i-1] + pool->objSize)) )
+            ++bad;
+         else
+            memset( obj[i], i, UMM_TEST_POOL_SIZE );
+      }
+
+      for( i = 0; i < UMM_TEST_POOL_COUNT; ++i ) {
+         if( obj[i] && (obj[i][UMM_TEST_POOL_SIZE-1] != i) )
+            ++bad;
+      }
+
+      umm_pool_free( pool, foreign );
+      umm_pool_free( pool, obj[0] ? obj[0] + 1 : (char *)NULL );
+
+      for( i = UMM_TEST_POOL_COUNT; i > 0; --i )
+         umm_pool_free( pool, obj[i-1] );
+   }
+
+   // Sizes that would wrap around, and no objects at all
+
+   if( umm_pool_create( (size_t)-3, 2 ) || umm_pool_create( (size_t)-1 / 2, 4 ) ||
+       umm_pool_create( 8, 0 ) )
+      ++bad;
+
+   umm_pool_destroy( pool );
+   umm_free( foreign );
+
+#ifdef UMM_CACHE
+   umm_cache_flush();
+#endif
+
+   umm_info( NULL, 0 );
+
+   printf( "pool   %d objects, %ld problems, %i blocks left in use%s\n",
+         UMM_TEST_POOL_COUNT, bad, (int)heapInfo.usedBlocks,
+         (bad || heapInfo.usedBlocks) ? " - FAILED" : "" );
+}
+
+// ----------------------------------------------------------------------------
+// The memalign check asks for every power of two up to 1K as the alignment,
+// with small blocks in between so that the heap doesn't stay aligned by
+// accident, and makes sure that the data really is aligned and that all of
+// it can be written. An alignment that is not a power of two is refused.
+// ----------------------------------------------------------------------------
+
+#define UMM_TEST_ALIGN_MAX (1024)
+
+static void umm_test_memalign( void ) {
+
+   void *ptr[2 * 11];
+
+   size_t alignment;
+   size_t size;
+
+   long bad = 0;
+
+   int n = 0;
+   int i;
+
+   umm_init( umm_heap_space, sizeof(umm_heap_space) );
+
+   for( alignment = 1; alignment <= UMM_TEST_ALIGN_MAX; alignment *= 2 ) {
+      size = 1 + (alignment * 3) % 200;
+
+      ptr[n] = umm_malloc( 1 + n );
+      ++n;
+
+      if( !(ptr[n] = umm_memalign( alignment, size )) || ((uintptr_t)ptr[n] % alignment) )
+         ++bad;
+      else
+         memset( ptr[n], 0x5a, size );
+      ++n;
+   }
+
+   if( umm_memalign( 24, 16 ) || umm_memalign( 0, 16 ) )
+      ++bad;
+
+   for( i = 0; i < n; ++i )
+      umm_free( ptr[i] );
+
+#ifdef UMM_CACHE
+   umm_cache_flush();
+#endif
+
+   umm_info( NULL, 0 );
+
+   printf( "align  up to %d bytes, %ld problems, %i blocks left in use%s\n",
+         UMM_TEST_ALIGN_MAX, bad, (int)heapInfo.usedBlocks,
+         (bad || heapInfo.usedBlocks) ? " - FAILED" : "" );
+}
+
+// ----------------------------------------------------------------------------
+// The bulk check first makes sure that objects which fit into one block are
+// handed out next to each other. Then it fills the heap, leaves a few gaps
+// that only take one object each and asks for more objects than there are
+// gaps - only some of them can be allocated, and the rest of ptrs must be
+// cleared. Every object is filled with its own number, so any overlap shows
+// up.
+// ----------------------------------------------------------------------------
+
+#define UMM_TEST_BULK_COUNT (32)
+#define UMM_TEST_BULK_HOLES (5)
+#define UMM_TEST_BULK_SIZE  (20)
+
+static void umm_test_bulk( void ) {
+
+   void *ptrs[UMM_TEST_BULK_COUNT];
+
+   void *head = (void *)NULL;
+   void *p;
+   void *q;
+
+   unsigned int whole;
+   unsigned int part;
+
+   long bad = 0;
+
+   int i;
+   int k;
+
+   umm_init( umm_heap_space, sizeof(umm_heap_space) );
+
+   whole = umm_malloc_bulk( UMM_TEST_BULK_SIZE, UMM_TEST_BULK_COUNT, ptrs );
 
-      if( UMM_NUMBLOCKS <= cf+blocks+1 ) {
-         DBG_LOG_DEBUG(  "Can't allocate %5i blocks at %5i\n", blocks, cf );
+   for( i = 1; i < (int)whole; ++i ) {
+      if( (char *)ptrs[i] - (char *)ptrs[i-1] != (char *)ptrs[1] - (char *)ptrs[0] )
+         ++bad;
+   }
 
-         // Release the critical section...
-         //
-         UMM_CRITICAL_EXIT();
+   umm_free_bulk( ptrs, UMM_TEST_BULK_COUNT );
 
-         return( (void *)NULL );
-      }
+   // Fill the heap with objects that are linked through their first bytes,
+   // newest first, and free every other one for the gaps
 
-      // Now check to see if we need to initialize the free list...this assumes
-      // that the BSS is set to 0 on startup. We should rarely get to the end of
-      // the free list so this is the "cheapest" place to put the initialization!
+   while( (p = umm_malloc( UMM_TEST_BULK_SIZE )) ) {
+      *(void **)p = head;
+      head        = p;
+   }
 
-      if( 0 == cf ) {
-         DBG_LOG_DEBUG( "Initializing malloc free block pointer\n" );
-         UMM_NBLOCK(0) = 1;
-         UMM_NFREE(0)  = 1;
-         cf            = 1;
+   for( p = head, i = 0; p && *(void **)p && (i < UMM_TEST_BULK_HOLES); ++i ) {
+      q           = *(void **)p;
+      *(void **)p = *(void **)q;
+      p           = *(void **)p;
+
+      umm_free( q );
+   }
+
+#ifdef UMM_CACHE
+   umm_cache_flush();
+#endif
+
+   part = umm_malloc_bulk( UMM_TEST_BULK_SIZE, UMM_TEST_BULK_COUNT, ptrs );
+
+   for( i = 0; i < UMM_TEST_BULK_COUNT; ++i ) {
+      if( (i < (int)part) == !ptrs[i] )
+         ++bad;
+      else if( ptrs[i] )
+         memset( ptrs[i], i, UMM_TEST_BULK_SIZE );
+   }
+
+   for( i = 0; i < (int)part; ++i ) {
+      for( k = 0; k < UMM_TEST_BULK_SIZE; ++k ) {
+         if( ptrs[i] && (((unsigned char *)ptrs[i])[k] != i) ) {
+            ++bad;
+            break;
+         }
       }
+   }
+
+   if( (whole != UMM_TEST_BULK_COUNT) || (part < UMM_TEST_BULK_HOLES) || (part >= UMM_TEST_BULK_COUNT) )
+      ++bad;
+
+   umm_free_bulk( ptrs, UMM_TEST_BULK_COUNT );
+
+   while( (p = head) ) {
+      head = *(void **)p;
+      umm_free( p );
+   }
+
+#ifdef UMM_CACHE
+   umm_cache_flush();
+#endif
+
+   umm_info( NULL, 0 );
+
+   printf( "bulk   %u of %d objects in one piece, %u in the gaps, %ld problems, %i blocks left in use%s\n",
+         whole, UMM_TEST_BULK_COUNT, part, bad, (int)heapInfo.usedBlocks,
+         (bad || heapInfo.usedBlocks) ? " - FAILED" : "" );
+}
+
+#ifdef UMM_HANDLES
+// ----------------------------------------------------------------------------
+// The handles check puts a plain block below each block with a handle, frees
+// the plain ones and lets umm_compact() close the gaps. Every unlocked block
+// has to move down with its data, and the one that is locked must stay
+// where it is.
+// ----------------------------------------------------------------------------
+
+#define UMM_TEST_HANDLE_COUNT (8)
+#define UMM_TEST_HANDLE_SIZE  (40)
+
+static void umm_test_handles( void ) {
+
+   void *plain[UMM_TEST_HANDLE_COUNT];
+   char *addr[UMM_TEST_HANDLE_COUNT];
+
+   umm_handle h[UMM_TEST_HANDLE_COUNT];
+
+   unsigned int moved = 0;
+
+   long bad = 0;
+
+   char *p;
 
-      DBG_LOG_DEBUG( "Allocating %6i blocks starting at %6i - new     \n", blocks, cf );
+   int i;
+   int k;
 
-      UMM_NFREE(UMM_PFREE(cf)) = cf+blocks;
+   umm_init( umm_heap_space, sizeof(umm_heap_space) );
 
-      memcpy( &UMM_BLOCK(cf+blocks), &UMM_BLOCK(cf), sizeof(umm_block) );
+   for( i = 0; i < UMM_TEST_HANDLE_COUNT; ++i ) {
+      plain[i] = umm_malloc( UMM_TEST_HANDLE_SIZE );
 
-      UMM_NBLOCK(cf)           = cf+blocks;
-      UMM_PBLOCK(cf+blocks)    = cf;
+      if( (h[i] = umm_halloc( UMM_TEST_HANDLE_SIZE )) && (addr[i] = (char *)umm_hlock( h[i] )) )
+         memset( addr[i], i, UMM_TEST_HANDLE_SIZE );
+      else
+         ++bad;
+
+      umm_hunlock( h[i] );
    }
 
-   // Release the critical section...
-   //
-   UMM_CRITICAL_EXIT();
+   if( umm_halloc( 0 ) || umm_hlock( 0 ) || umm_hlock( UMM_HANDLE_COUNT + 1 ) )
+      ++bad;
+
+   for( i = 0; i < UMM_TEST_HANDLE_COUNT; ++i )
+      umm_free( plain[i] );
+
+#ifdef UMM_CACHE
+   umm_cache_flush();
+#endif
+
+   // Keep the first block where it is, the cursor wraps around so a few
+   // rounds are plenty
+
+   umm_hlock( h[0] );
 
-   return( (void *)&UMM_DATA(cf) );
+   for( k = 0; k < 16; ++k )
+      moved += umm_compact( 4 * UMM_TEST_HANDLE_COUNT );
+
+   for( i = 0; i < UMM_TEST_HANDLE_COUNT; ++i ) {
+      if( !(p = (char *)umm_hlock( h[i] )) ) {
+         ++bad;
+         continue;
+      }
+
+      if( i ? (p >= addr[i]) : (p != addr[i]) )
+         ++bad;
+
+      for( k = 0; k < UMM_TEST_HANDLE_SIZE; ++k ) {
+         if( p[k] != i ) {
+            ++bad;
+            break;
+         }
+      }
+
+      umm_hunlock( h[i] );
+   }
+
+   umm_hunlock( h[0] );
+
+   for( i = 0; i < UMM_TEST_HANDLE_COUNT; ++i )
+      umm_hfree( h[i] );
+
+   umm_info( NULL, 0 );
+
+   printf( "handle %d handles, %u blocks moved, %ld problems, %i blocks left in use%s\n",
+         UMM_TEST_HANDLE_COUNT, moved, bad, (int)heapInfo.usedBlocks,
+         (bad || heapInfo.usedBlocks) ? " - FAILED" : "" );
 }
+#endif
 
+// ----------------------------------------------------------------------------
+// The region check sets up a small region of fast memory, one of DMA memory
+// and a big one that is both. A block that outgrows the small region has to
+// move to the big one with its data - never to the DMA region, which comes
+// first in the list - and a pointer that is not the start of a used block
+// is refused without moving anything. All regions must be empty again at
+// the end.
 // ----------------------------------------------------------------------------
 
-void *umm_realloc( void *ptr, size_t size ) {
+#define UMM_TEST_REGION_SMALL (1024)
+#define UMM_TEST_REGION_BIG   (4096)
 
-   unsigned short int blocks;
-   unsigned short int blockSize;
+static umm_block umm_test_small[UMM_TEST_REGION_SMALL / sizeof(umm_block)];
+static umm_block umm_test_dma[UMM_TEST_REGION_BIG / sizeof(umm_block)];
+static umm_block umm_test_big[UMM_TEST_REGION_BIG / sizeof(umm_block)];
 
-   unsigned short int c;
+static umm_region umm_test_region[3];
 
-   size_t curSize;
+static void umm_test_regions( void ) {
 
-   // This code looks after the case of a NULL value for ptr. The ANSI C
-   // standard says that if ptr is NULL and size is non-zero, then we've
-   // got to work the same a malloc(). If size is also 0, then our version
-   // of malloc() returns a NULL pointer, which is OK as far as the ANSI C
-   // standard is concerned.
+   char *ptr;
+   char *moved;
+   char *grown;
 
-   if( ((void *)NULL == ptr) ) {
-      DBG_LOG_DEBUG( "realloc the NULL pointer - call malloc()\n" );
+   unsigned int used = 0;
+
+   long bad = 0;
 
-      return( umm_malloc(size) );
+   int i;
+
+   umm_region_add( &umm_test_region[0], umm_test_small, sizeof(umm_test_small), UMM_FAST );
+   umm_region_add( &umm_test_region[1], umm_test_dma,   sizeof(umm_test_dma),   UMM_DMA );
+   umm_region_add( &umm_test_region[2], umm_test_big,   sizeof(umm_test_big),   UMM_FAST | UMM_DMA );
+
+   if( !(ptr = (char *)umm_region_malloc( 100, UMM_FAST )) ) {
+      printf( "region can't allocate a block - FAILED\n" );
+      return;
    }
 
-   // Now we're sure that we have a non_NULL ptr, but we're not sure what
-   // we should do with it. If the size is 0, then the ANSI C standard says that
-   // we should operate the same as free.
+   if( umm_region_heap( ptr ) != &umm_test_region[0].heap )
+      ++bad;
 
-   if( 0 == size ) {
-      DBG_LOG_DEBUG( "realloc to 0 size, just free the block\n" );
+   memset( ptr, 0x3c, 100 );
 
-      umm_free( ptr );
+   if( umm_region_realloc( ptr + 1, 2000 ) || umm_region_realloc( (char *)&bad, 2000 ) )
+      ++bad;
 
-      return( (void *)NULL );
+   // Too big for the small region, and once it's in the big one it can grow
+   // where it is
+
+   if( !(moved = (char *)umm_region_realloc( ptr, 2000 )) ) {
+      ++bad;
+      moved = ptr;
+   } else if( umm_region_heap( moved ) != &umm_test_region[2].heap ) {
+      ++bad;
    }
 
-   // Protect the critical section...
-   //
-   UMM_CRITICAL_ENTRY();
+   if( !(grown = (char *)umm_region_realloc( moved, 2100 )) ) {
+      ++bad;
+      grown = moved;
+   } else if( umm_region_heap( grown ) != umm_region_heap( moved ) ) {
+      ++bad;
+   }
 
-   // Otherwise we need to actually do a reallocation. A naiive approach
-   // would be to malloc() a new block of the correct size, copy the old data
-   // to the new block, and then free the old block.
-   //
-   // While this will work, we end up doing a lot of possibly unnecessary
-   // copying. So first, let's figure out how many blocks we'll need.
+   for( i = 0; i < 100; ++i ) {
+      if( 0x3c != grown[i] ) {
+         ++bad;
+         break;
+      }
+   }
 
-   blocks = umm_blocks( size );
+   umm_region_free( grown );
 
-   // Figure out which block we're in. Note the use of truncated division...
+   for( i = 0; i < 3; ++i ) {
+#ifdef UMM_CACHE
+      umm_cache_flush_h( &umm_test_region[i].heap );
+#endif
+      umm_info_h( &umm_test_region[i].heap, NULL, 0 );
 
-   c = (ptr-(void *)(&(umm_heap[0])))/sizeof(umm_block);
+      used += heapInfo.usedBlocks;
+   }
 
-   // Figure out how big this block is...
+   printf( "region 3 regions, %ld problems, %u blocks left in use%s\n",
+         bad, used, (bad || used) ? " - FAILED" : "" );
+}
 
-   blockSize = (UMM_NBLOCK(c) - c);
+// ----------------------------------------------------------------------------
+// The lifetime check takes short and long lived blocks in turn. The short
+// lived ones have to pile up from the bottom of the heap and the long lived
+// ones from the top, starting at the very top. After a few short lived
+// blocks are freed, the next long lived block still has to go right below
+// the others, not into one of the gaps - except with UMM_SEGREGATED_FIT,
+// where the size class picks the block.
+// ----------------------------------------------------------------------------
 
-   // Figure out how many bytes are in this block
+#define UMM_TEST_LIFE_COUNT (8)
+#define UMM_TEST_LIFE_SIZE  (32)
 
-   curSize   = (blockSize*sizeof(umm_block))-(sizeof(((umm_block *)0)->header));
+static void umm_test_lifetime( void ) {
 
-   // Ok, now that we're here, we know the block number of the original chunk
-   // of memory, and we know how much new memory we want, and we know the original
-   // block size...
+   char *shortLived[UMM_TEST_LIFE_COUNT];
+   char *longLived[UMM_TEST_LIFE_COUNT + 1];
 
-   if( blockSize == blocks ) {
-      // This space intentionally left blank - return the original pointer!
+   char *top = (char *)umm_heap_space + sizeof(umm_heap_space);
 
-      DBG_LOG_DEBUG( "realloc the same size block - %i, do nothing\n", blocks );
+   long bad = 0;
 
-      // Release the critical section...
-      //
-      UMM_CRITICAL_EXIT();
+   int i;
 
-      return( ptr );
+   umm_init( umm_heap_space, sizeof(umm_heap_space) );
+
+   for( i = 0; i < UMM_TEST_LIFE_COUNT; ++i ) {
+      shortLived[i] = (char *)umm_malloc_lifetime( UMM_TEST_LIFE_SIZE, UMM_SHORT_LIVED );
+      longLived[i]  = (char *)umm_malloc_lifetime( UMM_TEST_LIFE_SIZE, UMM_LONG_LIVED );
+
+      if( !shortLived[i] || !longLived[i] ) {
+         ++bad;
+         continue;
+      }
+
+      memset( shortLived[i], 1, UMM_TEST_LIFE_SIZE );
+      memset( longLived[i],  2, UMM_TEST_LIFE_SIZE );
+
+      if( i && ((shortLived[i] <= shortLived[i-1]) || (longLived[i] >= longLived[i-1])) )
+         ++bad;
    }
 
-   // Now we have a block size that could be bigger or smaller. Either
-   // way, try to assimilate up to the next block before doing anything...
-   //
-   // If it's still too small, we have to free it anyways and it will save the
-   // assimilation step later in free :-)
+   if( !bad && ((shortLived[UMM_TEST_LIFE_COUNT-1] >= longLived[UMM_TEST_LIFE_COUNT-1]) ||
+                (longLived[0] + 2 * UMM_TEST_LIFE_SIZE < top - 2 * sizeof(umm_block))) )
+      ++bad;
 
-   umm_assimilate_up( c );
+   for( i = 1; i < UMM_TEST_LIFE_COUNT - 1; i += 2 ) {
+      umm_free( shortLived[i] );
+      shortLived[i] = (char *)NULL;
+   }
 
-   // Now check if it might help to assimilate down, but don't actually
-   // do the downward assimilation unless the resulting block will hold the
-   // new request! If this block of code runs, then the new block will
-   // either fit the request exactly, or be larger than the request.
+#ifdef UMM_CACHE
+   umm_cache_flush();
+#endif
 
-   if( (UMM_NBLOCK(UMM_PBLOCK(c)) & UMM_FREELIST_MASK) &&
-         (blocks <= (UMM_NBLOCK(c)-UMM_PBLOCK(c)))    ) {
+   longLived[UMM_TEST_LIFE_COUNT] = (char *)umm_malloc_lifetime( UMM_TEST_LIFE_SIZE, UMM_LONG_LIVED );
 
-      // Check if the resulting block would be big enough...
+   if( !longLived[UMM_TEST_LIFE_COUNT] )
+      ++bad;
 
-      DBG_LOG_DEBUG( "realloc() could assimilate down %i blocks - fits!\n\r", c-UMM_PBLOCK(c) );
+#ifndef UMM_SEGREGATED_FIT
+   if( !bad && ((longLived[UMM_TEST_LIFE_COUNT] >= longLived[UMM_TEST_LIFE_COUNT-1]) ||
+                (longLived[UMM_TEST_LIFE_COUNT] <= shortLived[UMM_TEST_LIFE_COUNT-1])) )
+      ++bad;
+#endif
 
-      // Disconnect the previous block from the FREE list
+   for( i = 0; i < UMM_TEST_LIFE_COUNT; ++i ) {
+      umm_free( shortLived[i] );
+      umm_free( longLived[i] );
+   }
 
-      umm_disconnect_from_free_list( UMM_PBLOCK(c) );
+   umm_free( longLived[UMM_TEST_LIFE_COUNT] );
 
-      // Connect the previous block to the next block ... and then
-      // realign the current block pointer
+#ifdef UMM_CACHE
+   umm_cache_flush();
+#endif
 
-      c = umm_assimilate_down(c, 0);
+   umm_info( NULL, 0 );
 
-      // Move the bytes down to the new block we just created, but be sure to move
-      // only the original bytes.
+   printf( "life   %d short and %d long lived blocks, %ld problems, %i blocks left in use%s\n",
+         UMM_TEST_LIFE_COUNT, UMM_TEST_LIFE_COUNT + 1, bad, (int)heapInfo.usedBlocks,
+         (bad || heapInfo.usedBlocks) ? " - FAILED" : "" );
+}
 
-      memmove( (void *)&UMM_DATA(c), ptr, curSize );
+// ----------------------------------------------------------------------------
+// The constant size check makes sure that UMM_BLOCKS_CONST() agrees with
+// umm_blocks() right at the sizes where one more block is needed, and that
+// UMM_MALLOC_CONST() hands out a block that holds all of it. A size of 0 and
+// one that is too big for the heap get NULL, like from umm_malloc().
+// ----------------------------------------------------------------------------
 
-      // And don't forget to adjust the pointer to the new block location!
+#define UMM_TEST_CONST(size) \
+   do { \
+      if( (umm_blockno)UMM_BLOCKS_CONST(size) != umm_blocks( size ) ) \
+         ++bad; \
+      if( !(ptr = UMM_MALLOC_CONST(size)) || (umm_usable_size( ptr ) < (size)) ) \
+         ++bad; \
+      else \
+         memset( ptr, 0x7e, (size) ); \
+      umm_free( ptr ); \
+      ++sizes; \
+   } while( 0 )
 
-      ptr    = (void *)&UMM_DATA(c);
+static void umm_test_const( void ) {
+
+   void *ptr;
+
+   long bad = 0;
+
+   int sizes = 0;
+
+   umm_init( umm_heap_space, sizeof(umm_heap_space) );
+
+   UMM_TEST_CONST( 1 );
+   UMM_TEST_CONST( UMM_BODY_BYTES - UMM_SEAL_BYTES + 1 );
+   UMM_TEST_CONST( UMM_BODY_BYTES + UMM_BLOCK_BYTES - UMM_SEAL_BYTES );
+   UMM_TEST_CONST( UMM_BODY_BYTES + UMM_BLOCK_BYTES - UMM_SEAL_BYTES + 1 );
+   UMM_TEST_CONST( sizeof(umm_test_op) );
+   UMM_TEST_CONST( 100 );
+   UMM_TEST_CONST( 1000 );
+
+   if( UMM_MALLOC_CONST( 0 ) || UMM_MALLOC_CONST( sizeof(umm_heap_space) ) )
+      ++bad;
+
+#ifdef UMM_CACHE
+   umm_cache_flush();
+#endif
+
+   umm_info( NULL, 0 );
+
+   printf( "const  %d sizes, %ld problems, %i blocks left in use%s\n",
+         sizes, bad, (int)heapInfo.usedBlocks,
+         (bad || heapInfo.usedBlocks) ? " - FAILED" : "" );
+}
+
+// ----------------------------------------------------------------------------
+// The threads workload runs the same churn in 1 up to n threads at once,
+// all on the default heap. Each thread has slots of its own and does
+// mallocs, frees and reallocs of 8 to 96 bytes at random, so the heap and
+// its critical section are the only things the threads share. Every block
+// is tagged with its slot and checked before it is freed, which catches
+// blocks that were handed out twice.
+//
+// For each number of threads the report has the total throughput, the
+// speedup over one thread and the percentiles of the cost of a call over
+// all threads. Build it with the mutex, with UMM_TEST_SPINLOCK and with
+// UMM_CACHE (see umm_malloc_cfg.h) to compare them.
+// ----------------------------------------------------------------------------
+
+#ifdef UMM_TEST_THREADS
+
+#include <pthread.h>
+
+#define UMM_TEST_THREAD_SLOTS (16)
+#define UMM_TEST_THREAD_OPS   (UMM_TEST_OPS / 4)
+
+__thread int umm_test_thread;
+
+#ifdef UMM_TEST_SPINLOCK
+static volatile int umm_test_spin;
+
+void umm_test_lock( void ) {
+   while( __sync_lock_test_and_set( &umm_test_spin, 1 ) ) {
+      while( umm_test_spin )
+         ;
    }
+}
 
-   // Now calculate the block size again...and we'll have three cases
+void umm_test_unlock( void ) {
+   __sync_lock_release( &umm_test_spin );
+}
+#else
+static pthread_mutex_t umm_test_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-   blockSize = (UMM_NBLOCK(c) - c);
+void umm_test_lock( void ) {
+   pthread_mutex_lock( &umm_test_mutex );
+}
 
-   if( blockSize == blocks ) {
-      // This space intentionally left blank - return the original pointer!
+void umm_test_unlock( void ) {
+   pthread_mutex_unlock( &umm_test_mutex );
+}
+#endif
 
-      DBG_LOG_DEBUG( "realloc the same size block - %i, do nothing\n", blocks );
+#ifdef UMM_CACHE
+static const char *umm_test_cache = " and a cache per thread";
+#else
+static const char *umm_test_cache = "";
+#endif
 
-   } else if (blockSize > blocks ) {
-      // New block is smaller than the old block, so just make a new block
-      // at the end of this one and put it up on the free list...
+static unsigned long umm_test_thread_cost[UMM_TEST_MAX_THREADS * UMM_TEST_THREAD_OPS];
+static long          umm_test_thread_fails[UMM_TEST_MAX_THREADS];
+static long          umm_test_thread_bad[UMM_TEST_MAX_THREADS];
 
-      DBG_LOG_DEBUG( "realloc %i to a smaller block %i, shrink and free the leftover bits\n", blockSize, blocks );
+static void *umm_test_thread_run( void *arg ) {
 
-      umm_make_new_block( c, blocks, 0 );
+   unsigned char *ptr[UMM_TEST_THREAD_SLOTS];
+   size_t         size[UMM_TEST_THREAD_SLOTS];
 
-      umm_free( (void *)&UMM_DATA(c+blocks) );
-   } else {
-      // New block is bigger than the old block...
+   unsigned long *cost;
+   unsigned long  seed;
+   unsigned long  start;
 
-      void *oldptr = ptr;
+   unsigned char *p;
 
-      DBG_LOG_DEBUG( "realloc %i to a bigger block %i, make new, copy, and free the old\n", blockSize, blocks );
+   long i;
+   int  slot;
 
-      // Now umm_malloc() a new/ one, copy the old data to the new block, and
-      // free up the old block, but only if the malloc was sucessful!
+   umm_test_thread = (int)(intptr_t)arg;
 
-      if( (ptr = umm_malloc( size )) ) {
-         memcpy( ptr, oldptr, curSize );
+   cost = &umm_test_thread_cost[umm_test_thread * UMM_TEST_THREAD_OPS];
+   seed = 2463534242UL + umm_test_thread;
+
+   memset( ptr, 0, sizeof(ptr) );
+
+   for( i = 0; i < UMM_TEST_THREAD_OPS; ++i ) {
+      seed ^= (seed << 13) & 0xFFFFFFFFUL;
+      seed ^= (seed >> 17);
+      seed ^= (seed <<  5) & 0xFFFFFFFFUL;
+
+      slot = seed % UMM_TEST_THREAD_SLOTS;
+
+      if( ptr[slot] && (ptr[slot][0] != slot || ptr[slot][size[slot]-1] != slot) )
+         ++umm_test_thread_bad[umm_test_thread];
+
+      if( ptr[slot] && (seed & 0x100) ) {
+         start = UMM_TEST_CYCLES();
+         umm_free( ptr[slot] );
+         cost[i] = UMM_TEST_CYCLES() - start;
+
+         ptr[slot] = (unsigned char *)NULL;
+         continue;
       }
 
-      umm_free( oldptr );
+      size[slot] = 8 + (seed >> 9) % 89;
+
+      start = UMM_TEST_CYCLES();
+      p = ptr[slot] ? umm_realloc( ptr[slot], size[slot] ) : umm_malloc( size[slot] );
+      cost[i] = UMM_TEST_CYCLES() - start;
+
+      if( p ) {
+         ptr[slot] = p;
+         memset( p, slot, size[slot] );
+      } else {
+         ++umm_test_thread_fails[umm_test_thread];
+
+         // A failed realloc() leaves the old block alone, but it has the
+         // old size
+
+         if( ptr[slot] )
+            memset( ptr[slot], slot, size[slot] = 1 );
+      }
    }
 
-   // Release the critical section...
-   //
-   UMM_CRITICAL_EXIT();
+   for( slot = 0; slot < UMM_TEST_THREAD_SLOTS; ++slot )
+      umm_free( ptr[slot] );
 
-   return( ptr );
+#ifdef UMM_CACHE
+   umm_cache_flush();
+#endif
+
+   return( NULL );
+}
+
+static void umm_test_threads( int count ) {
+
+   pthread_t threads[UMM_TEST_MAX_THREADS];
+
+   unsigned long start;
+   unsigned long took;
+   unsigned long n;
+
+   double rate;
+   double single = 0;
+
+   long fails;
+   long bad;
+
+   int t;
+   int k;
+
+#if defined UMM_TEST_SPINLOCK
+   printf( "threads with a spinlock%s\n",    umm_test_cache );
+#else
+   printf( "threads with a pthread mutex%s\n", umm_test_cache );
+#endif
+
+   for( t = 1; t <= count; ++t ) {
+      umm_init( umm_heap_space, sizeof(umm_heap_space) );
+
+      umm_set_fit( umm_test_fit );
+
+      memset( umm_test_thread_fails, 0, sizeof(umm_test_thread_fails) );
+      memset( umm_test_thread_bad,   0, sizeof(umm_test_thread_bad)   );
+
+      start = umm_test_clock();
+
+      for( k = 0; k < t; ++k )
+         pthread_create( &threads[k], NULL, umm_test_thread_run, (void *)(intptr_t)k );
+
+      for( k = 0; k < t; ++k )
+         pthread_join( threads[k], NULL );
+
+      took = umm_test_clock() - start;
+
+      n    = (unsigned long)t * UMM_TEST_THREAD_OPS;
+      rate = n * 1e9 / (took ? took : 1);
+
+      if( 1 == t )
+         single = rate;
+
+      for( fails = bad = 0, k = 0; k < t; ++k ) {
+         fails += umm_test_thread_fails[k];
+         bad   += umm_test_thread_bad[k];
+      }
+
+      qsort( umm_test_thread_cost, n, sizeof(umm_test_thread_cost[0]), umm_test_compare );
+
+      umm_info( NULL, 0 );
+
+      printf( "   %d threads %10.0f calls/s %5.2fx   p50 %6lu   p99 %6lu   p99.9 %6lu   max %8lu   fails %ld   bad %ld   left %u\n",
+            t, rate, rate / single,
+            umm_test_thread_cost[n/2], umm_test_thread_cost[(n*99)/100],
+            umm_test_thread_cost[(n*999)/1000], umm_test_thread_cost[n-1],
+            fails, bad, (unsigned int)heapInfo.usedBlocks );
+   }
 }
+#endif
 
 // ----------------------------------------------------------------------------
 
-#ifdef UMM_TEST_MAIN
+int main( int argc, char *argv[] ) {
+
+#ifndef UMM_TLSF_FIT
+   const char *fit;
+#endif
+
+   printf( "Size of umm_heap is %i\n", (int)sizeof(umm_heap_space)       );
+   printf( "Size of header   is %i\n", (int)sizeof(umm_heap_space[0])    );
+   printf( "Size of nblock   is %i\n", (int)sizeof(umm_heap_space[0].header.used.next) );
+   printf( "Size of pblock   is %i\n", (int)sizeof(umm_heap_space[0].header.used.prev) );
+   printf( "Size of nfree    is %i\n", (int)sizeof(umm_heap_space[0].body.free.next)   );
+   printf( "Size of pfree    is %i\n", (int)sizeof(umm_heap_space[0].body.free.prev)   );
+
+   // -f best, -f first or -f next overrides the fit of the build
+
+   if( (argc > 2) && (0 == strcmp( argv[1], "-f" )) ) {
+      if( 0 == strcmp( argv[2], "first" ) )
+         umm_test_fit = UMM_FIT_FIRST;
+      else if( 0 == strcmp( argv[2], "next" ) )
+         umm_test_fit = UMM_FIT_NEXT;
+      else
+         umm_test_fit = UMM_FIT_BEST;
+
+      argc -= 2;
+      argv += 2;
+   }
+
+#ifdef UMM_TLSF_FIT
+   printf( "Fit strategy     is TLSF\n" );
+#else
+   fit = (UMM_FIT_NEXT  == umm_test_fit) ? "next fit"  :
+         (UMM_FIT_FIRST == umm_test_fit) ? "first fit" : "best fit";
 
-main() {
+#  ifdef UMM_SEGREGATED_FIT
+   printf( "Fit strategy     is segregated %s\n", fit );
+#  else
+   printf( "Fit strategy     is %s\n", fit );
+#  endif
+#endif
 
-   void * ptr_array[256];
+#ifdef UMM_TEST_THREADS
+   if( (argc > 2) && (0 == strcmp( argv[1], "-t" )) ) {
+      int count = atoi( argv[2] );
 
-   size_t i;
+      umm_test_threads( (count < 1) ? 1 : (count > UMM_TEST_MAX_THREADS) ? UMM_TEST_MAX_THREADS : count );
 
-   int idx;
+      return( 0 );
+   }
+#endif
 
-   printf( "Size of umm_heap is %i\n", sizeof(umm_heap)       );
-   printf( "Size of header   is %i\n", sizeof(umm_heap[0])    );
-   printf( "Size of nblock   is %i\n", sizeof(umm_heap[0].header.used.next) );
-   printf( "Size of pblock   is %i\n", sizeof(umm_heap[0].header.used.prev) );
-   printf( "Size of nfree    is %i\n", sizeof(umm_heap[0].body.free.next)   );
-   printf( "Size of pfree    is %i\n", sizeof(umm_heap[0].body.free.prev)   );
+#ifdef UMM_TRACE
+   if( (argc > 2) && (0 == strcmp( argv[1], "-w" )) ) {
+      if( (umm_test_record = fopen( argv[2], "wb" )) ) {
+         umm_test_run( "mixed", umm_test_mixed );
 
-   memset( umm_heap, 0, sizeof(umm_heap) );
+         umm_trace_start( (umm_trace_entry *)NULL, 0 );
 
-   umm_info( NULL, 1 );
+         fclose( umm_test_record );
+         umm_test_record = (FILE *)NULL;
+      } else {
+         printf( "Can't create trace %s\n", argv[2] );
+      }
+
+      return( 0 );
+   }
 
-   for( idx=0; idx<256; ++idx )
-      ptr_array[idx] = (void *)NULL;
-
-   for( idx=0; idx<6553500; ++idx ) {
-      i = rand()%256;
-
-      switch( rand() % 16 ) {
-
-         case  0:
-         case  1:
-         case  2:
-         case  3:
-         case  4:
-         case  5:
-         case  6: ptr_array[i] = umm_realloc(ptr_array[i], 0);
-                  break;
-         case  7:
-         case  8: ptr_array[i] = umm_realloc(ptr_array[i], rand()%40 );
-                  break;
-
-         case  9:
-         case 10:
-         case 11:
-         case 12: ptr_array[i] = umm_realloc(ptr_array[i], rand()%100 );
-                  break;
-
-         case 13:
-         case 14: ptr_array[i] = umm_realloc(ptr_array[i], rand()%200 );
-                  break;
-
-         default: ptr_array[i] = umm_realloc(ptr_array[i], rand()%400 );
-                  break;
+   if( (argc > 2) && (0 == strcmp( argv[1], "-b" )) ) {
+      if( (umm_test_file = fopen( argv[2], "rb" )) ) {
+         umm_test_run( "replay", umm_test_replay );
+
+         fclose( umm_test_file );
+      } else {
+         printf( "Can't open trace %s\n", argv[2] );
       }
 
+      return( 0 );
+   }
+#endif
+
+   umm_test_run( "mixed", umm_test_mixed );
+   umm_test_run( "churn", umm_test_churn );
+   umm_test_run( "fifo",  umm_test_fifo  );
+   umm_test_run( "grow",  umm_test_grow  );
+
+   umm_test_calloc( "zeroed", 1 );
+   umm_test_calloc( "dirty",  0 );
+
+   umm_test_pool();
+   umm_test_memalign();
+   umm_test_bulk();
+#ifdef UMM_HANDLES
+   umm_test_handles();
+#endif
+   umm_test_regions();
+   umm_test_lifetime();
+   umm_test_const();
+
+   if( argc > 1 ) {
+      if( (umm_test_file = fopen( argv[1], "r" )) ) {
+         umm_test_run( "trace", umm_test_trace );
+
+         fclose( umm_test_file );
+      } else {
+         printf( "Can't open trace %s\n", argv[1] );
+      }
    }
 
    umm_info( NULL, 1 );
 
+   return( 0 );
 }
 
 #endif
@@ -9,32 +9,439 @@
 
 // ----------------------------------------------------------------------------
 
+#include <stddef.h>
+#include <stdint.h>
 
+#include "umm_malloc_cfg.h"   //-- user-dependent
 
+// ----------------------------------------------------------------------------
+
+// Block numbers are 15 bits by default - the high order bit marks a free
+// block - which limits the heap to 32767 blocks.
+
+#ifdef UMM_BLOCKNO_32BIT
+typedef uint32_t umm_blockno;
+#  define UMM_BLOCKNO_BITS (31)
+#else
+typedef unsigned short int umm_blockno;
+#  define UMM_BLOCKNO_BITS (15)
+#endif
+
+// The size of a block, which umm_malloc.c checks against its own idea of it.
+// The body holds at least the free list pointers.
+
+#ifdef UMM_BLOCK_BODY_SIZE
+#  define UMM_BODY_BYTES  ((UMM_BLOCK_BODY_SIZE > 2 * sizeof(umm_blockno)) ? \
+                           UMM_BLOCK_BODY_SIZE : 2 * sizeof(umm_blockno))
+#else
+#  define UMM_BODY_BYTES  (2 * sizeof(umm_blockno))
+#endif
+#define UMM_BLOCK_BYTES   (2 * sizeof(umm_blockno) + UMM_BODY_BYTES)
+
+#ifdef UMM_TLSF_FIT
+#  ifndef UMM_SEGREGATED_FIT
+#    define UMM_SEGREGATED_FIT
+#  endif
+#endif
+
+#if defined UMM_TLSF_FIT
+#  define UMM_TLSF_SL_LOG2    (2)
+#  define UMM_TLSF_SL_COUNT   (1 << UMM_TLSF_SL_LOG2)
+#  define UMM_TLSF_FL_COUNT   (UMM_BLOCKNO_BITS - UMM_TLSF_SL_LOG2 + 1)
+#  define UMM_NUM_BINS        (UMM_TLSF_FL_COUNT * UMM_TLSF_SL_COUNT)
+#elif defined UMM_SEGREGATED_FIT
+#  define UMM_BIN_LINEAR_LOG2 (3)
+#  define UMM_BIN_LINEAR      (1 << UMM_BIN_LINEAR_LOG2)
+#  define UMM_NUM_BINS        (UMM_BIN_LINEAR - 1 + UMM_BLOCKNO_BITS - UMM_BIN_LINEAR_LOG2)
+#endif
+
+#ifdef UMM_CACHE
+typedef struct umm_cache_t {
+   umm_blockno         head[UMM_CACHE_MAX_BLOCKS];
+   unsigned char       count[UMM_CACHE_MAX_BLOCKS];
+}
+umm_cache;
+#endif
+
+#ifdef UMM_STATS
+typedef struct UMM_HEAP_STATS_t {
+   // The number of used blocks right now and the most there have ever
+   // been. The blocks that sit in a cache count as used.
+
+   umm_blockno usedBlocks;
+   umm_blockno usedBlocksMax;
+
+   // The number of free blocks, how many pieces they are in, and how many
+   // of those pieces have 2^n to 2^(n+1)-1 blocks
+
+   umm_blockno freeBlocks;
+   umm_blockno freeEntries;
+   umm_blockno freeHistogram[UMM_BLOCKNO_BITS];
+
+   // These are only filled in by umm_stats() - the largest free block, and
+   // the percentage of the free blocks that are not part of it
+
+   umm_blockno   largestFreeBlock;
+   unsigned char fragmentation;
+
+   // Successful and failed allocations, and frees. With UMM_CACHE the ones
+   // that are handled by a cache are not counted.
+
+   unsigned long allocs;
+   unsigned long allocFails;
+   unsigned long frees;
+
+   // How often umm_realloc() managed to grow a block by taking the next
+   // free block, by growing into the end of the heap, or by moving down into
+   // the previous free block, and how often it had to copy to a new block
+   // or failed
+
+   unsigned long reallocUp;
+   unsigned long reallocEnd;
+   unsigned long reallocDown;
+   unsigned long reallocCopy;
+   unsigned long reallocFail;
+}
+UMM_HEAP_STATS;
+#endif
+
+#ifdef UMM_TRACE
+// One recorded call - op is 'm' for umm_malloc(), 'f' for umm_free(), or 'r'
+// for umm_realloc(). ptr is the block that was returned or freed, old is the
+// block that was passed to umm_realloc(), and 0 stands for NULL. The entries
+// are meant to be sent to a host as they are, so build the host side with
+// the same UMM_BLOCKNO_32BIT setting.
+
+UMM_H_ATTPACKPRE typedef struct umm_trace_entry_t {
+   uint32_t      time;
+   uint32_t      size;
+   umm_blockno   ptr;
+   umm_blockno   old;
+   unsigned char op;
+} UMM_H_ATTPACKSUF umm_trace_entry;
+#endif
+
+#ifdef UMM_HANDLES
+// A block that can be moved by umm_compact(), see umm_halloc(). The handle
+// is the index of the entry in the handle table of the heap plus 1.
+
+typedef unsigned short int umm_handle;
+
+typedef struct umm_handle_entry_t {
+   umm_blockno   block;
+   unsigned char locks;
+} umm_handle_entry;
+#endif
+
+// ----------------------------------------------------------------------------
+// The heap context holds everything the allocator knows about a heap that
+// is not stored in the heap blocks themselves. It is set up by umm_init() or
+// umm_init_h(), so the members should be treated as read-only by the
+// application - with the exception of the lock, which is left alone by the
+// library.
+
+typedef struct umm_heap_t {
+   void               *pheap;
+   umm_blockno         numblocks;
+
+#ifdef UMM_HEAP_LOCK_TYPE
+   UMM_HEAP_LOCK_TYPE  lock;
+#endif
+
+#ifdef UMM_SEGREGATED_FIT
+   umm_blockno         bins[UMM_NUM_BINS];
+#endif
+#ifdef UMM_TLSF_FIT
+   umm_blockno         fl_bitmap;
+   unsigned char       sl_bitmap[UMM_TLSF_FL_COUNT];
+#endif
+
+#ifdef UMM_CACHE
+   umm_cache           cache[UMM_CACHE_COUNT];
+#endif
+
+#ifdef UMM_STATS
+   UMM_HEAP_STATS      stats;
+#endif
+
+#ifdef UMM_TRACE
+   umm_trace_entry    *trace;
+   unsigned int        traceSize;
+   unsigned int        traceHead;
+   unsigned int        traceCount;
+   unsigned long       traceLost;
+#endif
+
+   unsigned char       fit;
+#ifndef UMM_SEGREGATED_FIT
+   umm_blockno         rover;
+   umm_blockno         top;
+   umm_blockno         freeMax;
+#endif
+
+#ifdef UMM_PROFILE
+   unsigned int        visited;
+#endif
+
+#ifdef UMM_CRITICAL_BUDGET
+   unsigned int        generation;
+#endif
+
+#ifdef UMM_DEFERRED_FREE
+   volatile umm_blockno deferred;
+#endif
+
+   umm_blockno         scrub;
+   umm_blockno         pristine;
+
+#ifdef UMM_HANDLES
+   umm_handle_entry    handles[UMM_HANDLE_COUNT];
+   umm_blockno         compact;
+#endif
+}
+umm_heap;
 
 typedef struct UMM_HEAP_INFO_t {
-   unsigned short int totalEntries;
-   unsigned short int usedEntries;
-   unsigned short int freeEntries; 
+   umm_blockno totalEntries;
+   umm_blockno usedEntries;
+   umm_blockno freeEntries; 
 
-   unsigned short int totalBlocks; 
-   unsigned short int usedBlocks; 
-   unsigned short int freeBlocks; 
+   umm_blockno totalBlocks; 
+   umm_blockno usedBlocks; 
+   umm_blockno freeBlocks; 
 }
 UMM_HEAP_INFO;
 
 extern UMM_HEAP_INFO heapInfo;
 
+extern umm_heap umm_default_heap;
+
 extern char   __umm_heap_start[];
 extern char   __umm_heap_end[];
 extern size_t __umm_heap_size;
 
+void umm_init( void *base, size_t len );
+
 void *umm_info( void *ptr, int force );
 
 void *umm_malloc( size_t size );
 void *umm_realloc( void *ptr, size_t size );
 void umm_free( void *ptr );
 
+// Allocate num objects of size bytes that are cleared to 0. Memory that has
+// never been used is not cleared again, but only on the static heap before
+// any umm_init() - see umm_calloc_h() in umm_malloc.c
+
+void *umm_calloc( size_t num, size_t size );
+
+// Allocate size bytes with the data aligned to alignment bytes, which must
+// be a power of two. The memory is given back with umm_free().
+
+void *umm_memalign( size_t alignment, size_t size );
+
+// The number of bytes that can be used in the block at ptr, which may be more
+// than were asked for, and the number of bytes that a block of size bytes
+// would really get
+
+size_t umm_usable_size( void *ptr );
+size_t umm_good_size( size_t size );
+
+// umm_owns() tells if ptr points into the default heap at all, which is enough
+// to pick the right heap or allocator for it. umm_valid() also checks that it
+// points to a block that is in use. Both take constant time.
+
+int umm_owns( void *ptr );
+int umm_valid( void *ptr );
+
+// Check the next blocks blocks of the heap, and go on from there on the next
+// call. Returns the number of problems that were found.
+
+unsigned int umm_check_step( unsigned int blocks );
+
+// Allocate a block that is known to live for a short or a long time, which
+// keeps the two kinds in different ends of the heap
+
+#define UMM_SHORT_LIVED (1)
+#define UMM_LONG_LIVED  (2)
+
+void *umm_malloc_lifetime( size_t size, int lifetime );
+
+// UMM_MALLOC_CONST(sizeof(struct foo)) is umm_malloc() for a size that is a
+// constant. The number of blocks is worked out by the compiler the same way
+// umm_malloc() does it at run time, so the call goes straight to the cache
+// or the free list. A size of 0 or one that is too big for the heap ends up
+// in umm_malloc() as usual.
+
+#ifdef UMM_INTEGRITY
+#  define UMM_SEAL_BYTES  (sizeof(umm_blockno))
+#else
+#  define UMM_SEAL_BYTES  (0)
+#endif
+
+#define UMM_BLOCKS_CONST(size) \
+   ( ((size) + UMM_SEAL_BYTES <= UMM_BODY_BYTES) ? 1 : \
+     2 + ((size) + UMM_SEAL_BYTES - 1 - UMM_BODY_BYTES) / UMM_BLOCK_BYTES )
+
+#define UMM_MALLOC_CONST_FITS(size) \
+   ( (size) && (0 == (((size) / UMM_BLOCK_BYTES) >> (UMM_BLOCKNO_BITS - 1))) )
+
+#define UMM_MALLOC_CONST_H(heap, size) \
+   ( UMM_MALLOC_CONST_FITS(size) \
+     ? umm_malloc_const_h( (heap), (umm_blockno)UMM_BLOCKS_CONST(size), (size) ) \
+     : umm_malloc_h( (heap), (size) ) )
+
+#define UMM_MALLOC_CONST(size) UMM_MALLOC_CONST_H( &umm_default_heap, size )
+
+// Pick how the heap looks for a free block, the default comes from
+// UMM_BEST_FIT, UMM_FIRST_FIT or UMM_NEXT_FIT in umm_malloc_cfg.h and
+// umm_init() goes back to it
+
+#define UMM_FIT_BEST  (1)
+#define UMM_FIT_FIRST (2)
+#define UMM_FIT_NEXT  (3)
+
+void umm_set_fit( int fit );
+
+// Allocate count objects of size bytes in one go, preferably next to each
+// other. Returns the number of objects that were allocated, the rest of ptrs
+// is set to NULL. Each object is freed on its own with umm_free(), or all of
+// them with umm_free_bulk().
+
+unsigned int umm_malloc_bulk( size_t size, unsigned int count, void **ptrs );
+void umm_free_bulk( void **ptrs, unsigned int count );
+
+// The same functions for any other heap. Memory must always be returned to
+// the heap it was allocated from.
+
+void umm_init_h( umm_heap *heap, void *base, size_t len );
+
+void *umm_info_h( umm_heap *heap, void *ptr, int force );
+
+void *umm_malloc_h( umm_heap *heap, size_t size );
+void *umm_calloc_h( umm_heap *heap, size_t num, size_t size );
+void *umm_malloc_lifetime_h( umm_heap *heap, size_t size, int lifetime );
+void *umm_malloc_const_h( umm_heap *heap, umm_blockno blocks, size_t size );
+void *umm_realloc_h( umm_heap *heap, void *ptr, size_t size );
+void umm_free_h( umm_heap *heap, void *ptr );
+
+void *umm_memalign_h( umm_heap *heap, size_t alignment, size_t size );
+
+void umm_set_fit_h( umm_heap *heap, int fit );
+
+size_t umm_usable_size_h( umm_heap *heap, void *ptr );
+
+int umm_owns_h( umm_heap *heap, void *ptr );
+int umm_valid_h( umm_heap *heap, void *ptr );
+
+unsigned int umm_check_step_h( umm_heap *heap, unsigned int blocks );
+
+unsigned int umm_malloc_bulk_h( umm_heap *heap, size_t size, unsigned int count, void **ptrs );
+void umm_free_bulk_h( umm_heap *heap, void **ptrs, unsigned int count );
+
+// Fixed size object pools that live in a single chunk of a heap. The objects
+// have no header of their own and are allocated and freed in constant time.
+// umm_pool_destroy() gives the whole chunk back to the heap.
+
+typedef struct umm_pool_t umm_pool;
+
+umm_pool *umm_pool_create( size_t size, unsigned short int count );
+umm_pool *umm_pool_create_h( umm_heap *heap, size_t size, unsigned short int count );
+
+void *umm_pool_alloc( umm_pool *pool );
+void umm_pool_free( umm_pool *pool, void *ptr );
+void umm_pool_destroy( umm_pool *pool );
+
+// One heap that is made of several memory regions, each with flags that tell
+// what its memory is good for. Regions are added in the order they should be
+// used in, and each of them is a heap of its own. umm_region_malloc() takes
+// the first region that has all of the flags, or with UMM_SPILL any region
+// if none of those has room. umm_region_heap() returns the heap of the
+// region that ptr is in, or NULL.
+
+#define UMM_FAST     (0x0001)
+#define UMM_DMA      (0x0002)
+#define UMM_RETAINED (0x0004)
+#define UMM_SPILL    (0x8000)
+
+typedef struct umm_region_t {
+   umm_heap              heap;
+   unsigned int          flags;
+   struct umm_region_t  *next;
+} umm_region;
+
+void umm_region_add( umm_region *region, void *base, size_t len, unsigned int flags );
+umm_heap *umm_region_heap( void *ptr );
+
+void *umm_region_malloc( size_t size, unsigned int flags );
+void *umm_region_realloc( void *ptr, size_t size );
+void umm_region_free( void *ptr );
+
+#ifdef UMM_STATS
+// Get a copy of the counters of a heap. Unlike umm_info() this does not walk
+// the heap, so it's cheap enough to call often.
+
+void umm_stats( UMM_HEAP_STATS *stats );
+void umm_stats_h( umm_heap *heap, UMM_HEAP_STATS *stats );
+
+// Just the fragmentation percentage from umm_stats()
+
+int umm_fragmentation( void );
+int umm_fragmentation_h( umm_heap *heap );
+#endif
+
+#ifdef UMM_TRACE
+// Start recording into a ring buffer of the given number of entries, or
+// stop when buffer is NULL. umm_trace_read() moves up to max of the oldest
+// recorded entries out of the buffer and returns how many there were.
+// umm_init() stops a trace, but the lazy set up of the static heap does not.
+
+void umm_trace_start( umm_trace_entry *buffer, unsigned int entries );
+void umm_trace_start_h( umm_heap *heap, umm_trace_entry *buffer, unsigned int entries );
+
+unsigned int umm_trace_read( umm_trace_entry *entries, unsigned int max );
+unsigned int umm_trace_read_h( umm_heap *heap, umm_trace_entry *entries, unsigned int max );
+#endif
+
+#ifdef UMM_CACHE
+// Give all the blocks in the cache of the caller back to the heap, for
+// example before a task that has its own cache is deleted.
+
+void umm_cache_flush( void );
+void umm_cache_flush_h( umm_heap *heap );
+#endif
+
+#ifdef UMM_HANDLES
+// Allocate a block that umm_compact() may move, and get a handle for it, or
+// 0 if there is no memory or no free handle left. umm_hlock() returns the
+// address of the block, and it won't move until the same number of
+// umm_hunlock() calls. umm_compact() does up to steps steps of compaction
+// and returns the number of blocks it moved.
+
+umm_handle umm_halloc( size_t size );
+void umm_hfree( umm_handle h );
+void *umm_hlock( umm_handle h );
+void umm_hunlock( umm_handle h );
+unsigned int umm_compact( unsigned int steps );
+
+umm_handle umm_halloc_h( umm_heap *heap, size_t size );
+void umm_hfree_h( umm_heap *heap, umm_handle h );
+void *umm_hlock_h( umm_heap *heap, umm_handle h );
+void umm_hunlock_h( umm_heap *heap, umm_handle h );
+unsigned int umm_compact_h( umm_heap *heap, unsigned int steps );
+#endif
+
+#ifdef UMM_DEFERRED_FREE
+// Free a block later, without taking the critical section, so it can be
+// called from an interrupt handler. The block really goes back to the heap
+// on the next umm_malloc() on that heap or on umm_flush_deferred().
+
+void umm_free_deferred( void *ptr );
+void umm_free_deferred_h( umm_heap *heap, void *ptr );
+
+void umm_flush_deferred( void );
+void umm_flush_deferred_h( umm_heap *heap );
+#endif
+
 
 // ----------------------------------------------------------------------------
 
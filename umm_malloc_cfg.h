@@ -17,6 +17,22 @@
 //
 // Set this if you want to compile in the test suite at the end of this file.
 //
+// The test suite is a benchmark that measures each call with a cycle
+// counter. Define UMM_TEST_CYCLES() to read one on your target, for example
+// the DWT cycle counter of a Cortex-M:
+//
+// #define UMM_TEST_CYCLES() (DWT->CYCCNT)
+//
+// On a host it defaults to a nanosecond clock.
+//
+// -D UMM_TEST_THREADS
+//
+// Set this as well to build the test main for a host with pthreads (link it
+// with -pthread). It adds the threads workload (-t n), and binds the
+// critical section to a pthread mutex, or to a spinlock when you also set
+// -D UMM_TEST_SPINLOCK. With UMM_CACHE every test thread gets a cache of its
+// own. See the bindings below.
+//
 // If you leave this define unset, then you might want to set another one:
 //
 // -D UMM_REDEFINE_MEM_FUNCTIONS
@@ -39,6 +55,122 @@
 // Set this if you want to use a first-fit algorithm for allocating new
 // blocks
 //
+// -D UMM_NEXT_FIT
+//
+// Set this if you want to use a next-fit algorithm, which is first-fit that
+// starts looking where the previous search ended instead of at the head of
+// the free list.
+//
+// These only set the fit a heap starts out with, umm_set_fit_h() can change
+// it at any time.
+//
+// -D UMM_ADDRESS_ORDERED
+//
+// Set this if you want the free list to be kept in address order instead of
+// putting each freed block at its head. Together with UMM_FIRST_FIT this
+// packs the allocations towards the start of the heap. Freeing a block only
+// has to look at the blocks next to it to find its place in the list, not
+// at the whole list. It has no effect with UMM_SEGREGATED_FIT.
+//
+// -D UMM_SEGREGATED_FIT
+//
+// Set this if you want the free blocks to be kept on several lists, one
+// per size class, instead of on a single list. The small classes hold
+// blocks of exactly 1 to 7 blocks, the remaining ones cover a power of two
+// range each. UMM_BEST_FIT or UMM_FIRST_FIT then only apply to the short scan
+// of the list that matches the request.
+//
+// -D UMM_TLSF_FIT
+//
+// Set this if you want a two-level segregated fit, which implies
+// UMM_SEGREGATED_FIT. Each power of two range is split into 4 size classes,
+// and a pair of bitmaps records which classes hold a free block, so the
+// class to allocate from is found with a couple of count-leading/trailing
+// zeros instructions instead of a list walk. The request is rounded up to
+// the next class, which bounds the time spent in umm_malloc() at the cost
+// of slightly more fragmentation.
+//
+// -D UMM_BLOCKNO_32BIT
+//
+// Set this if your heap has more than 32767 blocks. The block numbers are
+// then 31 bits instead of 15, and the block header grows from 4 to 8 bytes.
+//
+// -D UMM_CACHE
+//
+// Set this if you want small blocks to be freed to and allocated from a
+// cache per task or per core (see the UMM_CACHE_xxx settings below) without
+// taking the critical section of the heap. Blocks in a cache count as used
+// blocks in umm_info().
+//
+// -D UMM_STATS
+//
+// Set this if you want each heap to keep counters that can be read with
+// umm_stats() - the number of used and free blocks, the high-water mark,
+// the largest free block, the number of allocations and frees and how
+// umm_realloc() managed to grow blocks. They are updated as the heap
+// changes, so unlike umm_info() there is no need to walk the heap.
+//
+// -D UMM_TRACE
+//
+// Set this if you want to be able to record the calls to umm_malloc(),
+// umm_free() and umm_realloc() in a ring buffer with umm_trace_start(), so
+// that they can be replayed on a host later. The time stamp of each entry
+// comes from UMM_TRACE_TIME() below.
+//
+// -D UMM_PROFILE
+//
+// Set this to count the free list entries that each allocation looks at
+// before it finds a block. The count is handed to UMM_PROFILE_END() below,
+// and the one for the latest allocation is in the visited member of the
+// heap context.
+//
+// -D UMM_CRITICAL_BUDGET
+//
+// Set this if a scan of a long free list must not keep the critical section
+// for all of its length. The scan then lets go of the critical section every
+// UMM_CRITICAL_STEPS free list entries (see below) and starts over if the
+// free list was changed in the meantime. Only the scan of umm_malloc() does
+// this, the ones inside umm_realloc() and the others keep the critical
+// section. It has no effect with UMM_SEGREGATED_FIT, which only ever scans a
+// single size class.
+//
+// -D UMM_DEFERRED_FREE
+//
+// Set this if you want umm_free_deferred(), which can be called from an
+// interrupt handler. It puts the block on a list with UMM_DEFERRED_CAS()
+// (see below) instead of taking the critical section, and the list is freed
+// in one go by the next umm_malloc() or by umm_flush_deferred().
+//
+// -D UMM_HANDLES
+//
+// Set this if you want umm_halloc(), which allocates blocks that are known
+// by a handle instead of a pointer, so that umm_compact() can move them
+// down to get the free space back into one piece. Each heap has room for
+// UMM_HANDLE_COUNT handles (see below).
+//
+// -D UMM_CHECK_POINTERS
+//
+// Set this if umm_free() and umm_realloc() should refuse pointers that are
+// not the start of a used block of the heap, like pointers into another heap
+// or blocks that were already freed. The check only looks at the block and
+// its neighbours, so it takes constant time. Refused pointers are passed to
+// UMM_BAD_POINTER() below. With UMM_CACHE the check takes the critical
+// section of the heap.
+//
+// -D UMM_INTEGRITY
+//
+// Set this to put a check value made from the block header after the data
+// of every used block. It's checked when the block is freed or reallocated,
+// and by umm_check_step(), so a header or the end of a block that was
+// written over is noticed. It costs a few bytes per block.
+//
+// -D UMM_POISON_FREE
+//
+// Set this to fill the first few bytes of every free block with a pattern
+// (see UMM_POISON_SIZE below) that is checked when the block is merged with
+// another one and by umm_check_step(). That catches writes to blocks that
+// were already freed.
+//
 // -D UMM_DBG_LOG_LEVEL=n
 //
 // Set n to a value from 0 to 6 depending on how verbose you want the debug
@@ -63,9 +195,29 @@
 
 
 // ----------------------------------------------------------------------------
-// Size of the heap in bytes
+// Size of the heap in bytes. The heap is then a static array that is set up
+// by the first call to umm_malloc(), which relies on the BSS being cleared
+// by the startup code.
+//
+// Leave this undefined if the heap lives somewhere else, for example in a
+// memory region that is set up by the linker. umm_init() MUST then be called
+// before any other function of the library:
+//
+//    umm_init( __umm_heap_start, __umm_heap_end - __umm_heap_start );
+//
+// This also saves the check for an uninitialized heap in umm_malloc().
 #define UMM_MALLOC_CFG__HEAP_SIZE 8192
 
+// ----------------------------------------------------------------------------
+// Number of data bytes in the body of a block. The default is just enough
+// for the free list pointers, which gives 8 byte blocks with 15 bit block
+// numbers and 16 byte blocks with UMM_BLOCKNO_32BIT. Bigger blocks mean fewer
+// block numbers for big heaps and big objects, and more waste for small
+// ones. Pick a value that makes the block size a power of two, so that the
+// pointer to block number conversions are simple shifts.
+//
+// #define UMM_BLOCK_BODY_SIZE (24)
+
 // ----------------------------------------------------------------------------
 // A couple of macros to make packing structures less compiler dependent
 
@@ -78,11 +230,139 @@
 // your system uses for this purpose. You can disable interrupts entirely, or
 // just disable task switching - it's up to you
 //
-// NOTE WELL that these macros MUST be allowed to nest, because umm_free() is
-// called from within umm_malloc()
+// The library never enters the critical section while it is already in it,
+// so the macros don't have to nest.
+
+#if defined UMM_TEST_MAIN && defined UMM_TEST_THREADS
+   extern void umm_test_lock( void );
+   extern void umm_test_unlock( void );
+#  define UMM_CRITICAL_ENTRY() umm_test_lock()
+#  define UMM_CRITICAL_EXIT()  umm_test_unlock()
+#else
+#  define UMM_CRITICAL_ENTRY()
+#  define UMM_CRITICAL_EXIT()
+#endif
+
+// If there is more than one heap (see umm_init_h()) they all share the
+// critical section above. To give each heap its own lock instead, define
+// UMM_HEAP_CRITICAL_ENTRY and UMM_HEAP_CRITICAL_EXIT - they get the heap
+// context that is being worked on. UMM_HEAP_LOCK_TYPE adds a member of that
+// type called "lock" to each heap context, which the library never touches.
+// They don't have to nest either. For example:
+//
+// #define UMM_HEAP_LOCK_TYPE             SemaphoreHandle_t
+// #define UMM_HEAP_CRITICAL_ENTRY(heap)  xSemaphoreTake( (heap)->lock, portMAX_DELAY )
+// #define UMM_HEAP_CRITICAL_EXIT(heap)   xSemaphoreGive( (heap)->lock )
+
+// ----------------------------------------------------------------------------
+// The time stamp for trace entries with UMM_TRACE, for example a tick count
+// or a cycle counter
+
+#define UMM_TRACE_TIME() (0)
+
+// ----------------------------------------------------------------------------
+// Hooks for profiling the allocator. UMM_PROFILE_BEGIN(op) is called when
+// umm_malloc(), umm_free() or umm_realloc() starts to do real work, and
+// UMM_PROFILE_END(op,visited) when it is done, with op being 'm', 'f' or
+// 'r' just like in the trace entries. A call of umm_realloc() that frees
+// the block or has no block to start with is profiled as umm_free() or
+// umm_malloc(). Calls that do nothing at all are not profiled.
+//
+// visited is the number of free list entries that were looked at (see
+// UMM_PROFILE above), and 0 without UMM_PROFILE. UMM_PROFILE_END() is called
+// before the critical section is released, so it should be quick. For
+// example, to get the cycles per call on a Cortex-M:
+//
+// #define UMM_PROFILE_BEGIN(op)         uint32_t umm_profile_start = DWT->CYCCNT
+// #define UMM_PROFILE_END(op,visited)   my_trace( (op), DWT->CYCCNT - umm_profile_start, (visited) )
+//
+// They're empty by default, so they don't cost anything.
+
+#define UMM_PROFILE_BEGIN(op)
+#define UMM_PROFILE_END(op,visited)
+
+// ----------------------------------------------------------------------------
+// Clears the memory that umm_calloc() hands out. This could be a word wide
+// fill or a DMA transfer, for big blocks it's worth it.
+
+#define UMM_CALLOC_ZERO(ptr,size) memset( (ptr), 0, (size) )
+
+// ----------------------------------------------------------------------------
+// Called for every pointer that UMM_CHECK_POINTERS refuses, outside of the
+// critical section. This is a good place for a breakpoint or an assert().
+
+#define UMM_BAD_POINTER(heap,ptr)
+
+// ----------------------------------------------------------------------------
+// Called inside the critical section for every block UMM_INTEGRITY,
+// UMM_POISON_FREE or umm_check_step() finds to be corrupt, with b being the
+// block number. A block that is corrupt is never freed.
+
+#define UMM_HEAP_CORRUPT(heap,b)
+
+// ----------------------------------------------------------------------------
+// The pattern and the number of bytes at the start of every free block that
+// UMM_POISON_FREE fills, only used with UMM_POISON_FREE. A bigger size finds
+// more writes to freed blocks, but it makes umm_free() slower.
+
+#define UMM_POISON_BYTE (0xa5)
+#define UMM_POISON_SIZE (16)
+
+// ----------------------------------------------------------------------------
+// Settings for the free list scan, only used with UMM_CRITICAL_BUDGET.
+//
+// The scan leaves the critical section for a moment after every
+// UMM_CRITICAL_STEPS entries of the free list, which bounds the time spent
+// in it. After UMM_CRITICAL_RESTARTS restarts it keeps the critical section
+// until it is done.
+
+#define UMM_CRITICAL_STEPS    (16)
+#define UMM_CRITICAL_RESTARTS (4)
+
+// ----------------------------------------------------------------------------
+// The compare and swap for the list of deferred frees, only used with
+// UMM_DEFERRED_FREE. It sets *p to n if it still holds o, and it returns
+// nonzero if it did. The default is the GCC builtin - on a core without an
+// atomic compare and swap it's fine to do it with interrupts disabled.
+
+#define UMM_DEFERRED_CAS(p,o,n) __sync_bool_compare_and_swap( (p), (o), (n) )
+
+// ----------------------------------------------------------------------------
+// The number of handles per heap, only used with UMM_HANDLES. Each handle
+// takes a few bytes in the heap context, and umm_compact() looks through
+// all of them for every block it might move.
+
+#define UMM_HANDLE_COUNT (32)
+
+// ----------------------------------------------------------------------------
+// Settings for the small object caches, only used with UMM_CACHE.
+//
+// There are UMM_CACHE_COUNT caches per heap, and UMM_CACHE_ID() picks the one
+// that belongs to the caller - that could be the number of the current core,
+// or an index stored with the current task. UMM_CACHE_ENTRY/EXIT only have to
+// protect the caller's cache against other users of the same cache. For a
+// per-task cache they can be empty (unless blocks are freed from interrupts),
+// for a per-core cache disabling interrupts on the current core is enough.
+//
+// Blocks of 1 to UMM_CACHE_MAX_BLOCKS blocks are cached, and they move
+// between a cache and the heap UMM_CACHE_DEPTH/2 at a time.
+
+#if defined UMM_TEST_MAIN && defined UMM_TEST_THREADS
+   // One cache per test thread, which nobody else ever touches
+
+   extern __thread int umm_test_thread;
+#  define UMM_TEST_MAX_THREADS  (8)
+#  define UMM_CACHE_COUNT       (UMM_TEST_MAX_THREADS)
+#  define UMM_CACHE_ID()        (umm_test_thread)
+#else
+#  define UMM_CACHE_COUNT       (1)
+#  define UMM_CACHE_ID()        (0)
+#endif
+#define UMM_CACHE_ENTRY()
+#define UMM_CACHE_EXIT()
 
-#define UMM_CRITICAL_ENTRY()
-#define UMM_CRITICAL_EXIT()
+#define UMM_CACHE_MAX_BLOCKS  (4)
+#define UMM_CACHE_DEPTH       (8)
 
 
 